@@ -0,0 +1,294 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Marks the interface of libbulk, which is built with hidden visibility.
+ */
+#ifndef BULK_EXPORT
+#define BULK_EXPORT __attribute__((visibility("default")))
+#endif
+
+/**
+ * @brief In-process API of the batch command processor.
+ *
+ * Link against libbulk to form bulks inside a service instead of piping
+ * commands to the bulk executable.
+ */
+
+/**
+ * @brief Commands of a bulk, stored as a structure of arrays: the bytes of
+ * all commands back to back and the offset each one starts at.
+ *
+ * Formatting, serializing and checksumming a bulk thus read memory in order,
+ * and a list that is cleared and refilled allocates nothing once it has grown.
+ */
+class CommandList
+{
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::string_view;
+
+        /**
+         * @brief What operator-> returns, as commands are views made on the fly.
+         */
+        class pointer
+        {
+        public:
+            explicit pointer(std::string_view command)
+                : mCommand(command)
+            {
+            }
+
+            const std::string_view* operator->() const
+            {
+                return &mCommand;
+            }
+
+        private:
+            std::string_view mCommand;
+        };
+
+        const_iterator()
+            : mList(nullptr)
+            , mIndex(0)
+        {
+        }
+
+        const_iterator(const CommandList& list, size_t index)
+            : mList(&list)
+            , mIndex(index)
+        {
+        }
+
+        std::string_view operator*() const
+        {
+            return (*mList)[mIndex];
+        }
+
+        pointer operator->() const
+        {
+            return pointer((*mList)[mIndex]);
+        }
+
+        const_iterator& operator++()
+        {
+            ++mIndex;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator previous = *this;
+            ++mIndex;
+            return previous;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return mIndex == other.mIndex;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return mIndex != other.mIndex;
+        }
+
+    private:
+        const CommandList* mList;
+        size_t mIndex;
+    };
+
+    size_t size() const
+    {
+        return mOffsets.size();
+    }
+
+    bool empty() const
+    {
+        return mOffsets.empty();
+    }
+
+    std::string_view operator[](size_t i) const
+    {
+        size_t end = i + 1 < mOffsets.size() ? mOffsets[i + 1] : mBytes.size();
+        return std::string_view(mBytes.data() + mOffsets[i], end - mOffsets[i]);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(*this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(*this, mOffsets.size());
+    }
+
+    void push_back(std::string_view command)
+    {
+        mOffsets.push_back(mBytes.size());
+        mBytes.append(command);
+    }
+
+    /**
+     * @brief Appends all commands of another list at once.
+     */
+    void Append(const CommandList& other)
+    {
+        size_t shift = mBytes.size();
+        size_t first = mOffsets.size();
+        mBytes.append(other.mBytes);
+        mOffsets.insert(mOffsets.end(), other.mOffsets.begin(), other.mOffsets.end());
+        for (size_t i = first; i < mOffsets.size(); ++i)
+            mOffsets[i] += shift;
+    }
+
+    void clear()
+    {
+        mOffsets.clear();
+        mBytes.clear();
+    }
+
+    /**
+     * @brief All commands back to back.
+     */
+    std::string_view Bytes() const
+    {
+        return mBytes;
+    }
+
+    /**
+     * @brief Where each command starts within Bytes().
+     */
+    const std::vector<uint64_t>& Offsets() const
+    {
+        return mOffsets;
+    }
+
+    /**
+     * @brief Replaces the commands with count ones starting at the offsets
+     * within bytes; the offsets have to be ascending and within bytes.
+     */
+    void Assign(std::string_view bytes, const uint64_t* offsets, size_t count)
+    {
+        mBytes.assign(bytes);
+        mOffsets.assign(offsets, offsets + count);
+    }
+
+private:
+    std::string mBytes;
+    std::vector<uint64_t> mOffsets;
+};
+
+/**
+ * @brief Commands dumped together, as handed to the sinks.
+ *
+ * Text is the "bulk: a, b, c" line, formatted once for all text sinks.
+ * Continued marks a part of a dynamic block split for being too large,
+ * other than the last; its text ends with ", ...".
+ */
+struct Bulk
+{
+    CommandList Commands;
+    std::string Text;
+    std::chrono::system_clock::time_point Timestamp;
+    bool Continued = false;
+};
+
+/**
+ * @brief Receives the bulks formed by a BulkEngine.
+ */
+class BULK_EXPORT BulkSink
+{
+public:
+    virtual ~BulkSink() = default;
+
+    /**
+     * @brief Called on the thread submitting commands; the bulk is only valid during the call.
+     */
+    virtual void Write(const Bulk& bulk) = 0;
+};
+
+/**
+ * @brief Forms bulks from commands exactly as the bulk executable does for one input stream.
+ *
+ * Commands are submitted one line at a time, "{" and "}" included. Bulks go
+ * to the registered sinks, in registration order, and then to the report
+ * files unless "reports" is false. An engine is not thread safe; use one
+ * per stream.
+ */
+class BULK_EXPORT BulkEngine
+{
+public:
+    /**
+     * @param settings Same keys and values as the config file of the bulk
+     * executable; bulk-size is required. Settings that concern the input
+     * or the process rather than one stream, namely jobs, journal and
+     * memory-limit, are rejected. Engines never stop for signals, and their
+     * metrics go to the process-wide counters the executable prints.
+     *
+     * @throw std::invalid_argument on an unknown or invalid setting.
+     * @throw std::runtime_error if the report directory, a dictionary or a
+     * plugin the settings name cannot be opened.
+     */
+    explicit BulkEngine(const std::map<std::string, std::string>& settings);
+
+    /**
+     * @brief Dumps the pending static bulk, like the end of input does, and
+     * waits for the report files to be written.
+     */
+    ~BulkEngine();
+
+    BulkEngine(const BulkEngine&) = delete;
+    BulkEngine& operator=(const BulkEngine&) = delete;
+
+    /**
+     * @brief Registers a sink, which has to outlive the engine.
+     *
+     * @throw std::invalid_argument with block-overflow=stream, as sinks take whole bulks only.
+     */
+    void AddSink(BulkSink& sink);
+
+    void Submit(std::string_view command);
+
+    /**
+     * @brief Submits every line of the text; a last line need not end with a newline.
+     */
+    void SubmitLines(std::string_view lines);
+
+    /**
+     * @brief Dumps the static bulk collected so far; a dynamic block is left open.
+     */
+    void Flush();
+
+    /**
+     * @brief Dumps the static bulk if it exceeded bulk-time-limit; call it
+     * periodically while no commands arrive.
+     */
+    void Tick();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> mImpl;
+};
+
+/**
+ * @brief Runs the bulk command line tool.
+ *
+ * @return The exit status.
+ */
+BULK_EXPORT int BulkCommandLine(int argc, char const** argv);
@@ -0,0 +1,199 @@
+#include "bulk_c.h"
+#include "bulk.h"
+
+#include <exception>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct bulk_engine
+{
+    explicit bulk_engine(const std::map<std::string, std::string>& settings)
+        : Engine(settings)
+    {
+    }
+
+    // Declared first, as the engine flushes into them when destroyed.
+    std::vector<std::unique_ptr<BulkSink>> Sinks;
+    BulkEngine Engine;
+};
+
+static thread_local std::string LastError;
+
+namespace
+{
+
+/**
+ * @brief Passes bulks to a C function; the command array is reused between bulks.
+ */
+class FunctionSink : public BulkSink
+{
+public:
+    FunctionSink(bulk_sink_function function, void* context)
+        : mFunction(function)
+        , mContext(context)
+    {
+    }
+
+    void Write(const Bulk& bulk) override
+    {
+        mCommands.clear();
+        for (const auto& command : bulk.Commands)
+            mCommands.push_back(bulk_command{command.data(), command.size()});
+        bulk_view view{mCommands.data(), mCommands.size(), bulk.Text.data(), bulk.Text.size(),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(bulk.Timestamp.time_since_epoch()).count()};
+        mFunction(mContext, &view);
+    }
+
+private:
+    bulk_sink_function mFunction;
+    void* mContext;
+    std::vector<bulk_command> mCommands;
+};
+
+} // namespace
+
+/**
+ * @brief Runs the call, turning exceptions into error codes, as they must not cross the C boundary.
+ */
+template <typename Function>
+static int Call(Function function)
+{
+    try
+    {
+        function();
+        LastError.clear();
+        return BULK_OK;
+    }
+    catch (const std::invalid_argument& e)
+    {
+        LastError = e.what();
+        return BULK_ERROR_INVALID_ARGUMENT;
+    }
+    catch (const std::exception& e)
+    {
+        LastError = e.what();
+        return BULK_ERROR_FAILED;
+    }
+    catch (...)
+    {
+        LastError = "Unknown error";
+        return BULK_ERROR_FAILED;
+    }
+}
+
+int bulk_abi_version(void)
+{
+    return BULK_ABI_VERSION;
+}
+
+const char* bulk_last_error(void)
+{
+    return LastError.c_str();
+}
+
+int bulk_engine_create(const char* const* keys, const char* const* values, size_t count, bulk_engine** engine)
+{
+    return Call([=]()
+    {
+        if (!engine || (count != 0 && (!keys || !values)))
+            throw std::invalid_argument("Null argument");
+        std::map<std::string, std::string> settings;
+        for (size_t i = 0; i < count; ++i)
+            settings[keys[i]] = values[i];
+        *engine = new bulk_engine(settings);
+    });
+}
+
+void bulk_engine_destroy(bulk_engine* engine)
+{
+    Call([=]() { delete engine; });
+}
+
+int bulk_engine_add_sink(bulk_engine* engine, bulk_sink_function sink, void* context)
+{
+    return Call([=]()
+    {
+        if (!engine || !sink)
+            throw std::invalid_argument("Null argument");
+        auto functionSink = std::make_unique<FunctionSink>(sink, context);
+        engine->Sinks.reserve(engine->Sinks.size() + 1);
+        engine->Engine.AddSink(*functionSink);
+        engine->Sinks.push_back(std::move(functionSink));
+    });
+}
+
+int bulk_submit(bulk_engine* engine, const char* data, size_t size)
+{
+    return Call([=]()
+    {
+        if (!engine || (size != 0 && !data))
+            throw std::invalid_argument("Null argument");
+        engine->Engine.Submit(std::string_view(data, size));
+    });
+}
+
+int bulk_submit_batch(bulk_engine* engine, const bulk_command* commands, size_t count)
+{
+    return Call([=]()
+    {
+        if (!engine || (count != 0 && !commands))
+            throw std::invalid_argument("Null argument");
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (commands[i].size != 0 && !commands[i].data)
+                throw std::invalid_argument("Null command");
+        }
+        for (size_t i = 0; i < count; ++i)
+            engine->Engine.Submit(std::string_view(commands[i].data, commands[i].size));
+    });
+}
+
+int bulk_submit_buffer(bulk_engine* engine, const char* buffer, const size_t* offsets, size_t count)
+{
+    return Call([=]()
+    {
+        if (!engine || !offsets || (offsets[count] != offsets[0] && !buffer))
+            throw std::invalid_argument("Null argument");
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (offsets[i + 1] < offsets[i])
+                throw std::invalid_argument("Offsets must not decrease");
+        }
+        for (size_t i = 0; i < count; ++i)
+            engine->Engine.Submit(std::string_view(buffer + offsets[i], offsets[i + 1] - offsets[i]));
+    });
+}
+
+int bulk_submit_lines(bulk_engine* engine, const char* buffer, size_t size)
+{
+    return Call([=]()
+    {
+        if (!engine || (size != 0 && !buffer))
+            throw std::invalid_argument("Null argument");
+        engine->Engine.SubmitLines(std::string_view(buffer, size));
+    });
+}
+
+int bulk_flush(bulk_engine* engine)
+{
+    return Call([=]()
+    {
+        if (!engine)
+            throw std::invalid_argument("Null argument");
+        engine->Engine.Flush();
+    });
+}
+
+int bulk_tick(bulk_engine* engine)
+{
+    return Call([=]()
+    {
+        if (!engine)
+            throw std::invalid_argument("Null argument");
+        engine->Engine.Tick();
+    });
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Marks the interface of libbulk, which is built with hidden visibility.
+ */
+#ifndef BULK_EXPORT
+#define BULK_EXPORT __attribute__((visibility("default")))
+#endif
+
+/**
+ * @brief C interface of libbulk, for C and for foreign function interfaces
+ * such as Python ctypes or Go cgo.
+ *
+ * It wraps BulkEngine. Commands may be submitted in batches so that a caller
+ * pays for one call per batch rather than per command. Functions return
+ * BULK_OK or a negative error code, and bulk_last_error() describes the
+ * last error of the calling thread. A null engine, or a null pointer to data
+ * that is not empty, is BULK_ERROR_INVALID_ARGUMENT. Structures only ever grow at the end;
+ * bulk_abi_version() tells which version the library implements.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BULK_ABI_VERSION 1
+
+#define BULK_OK 0
+#define BULK_ERROR_INVALID_ARGUMENT -1
+#define BULK_ERROR_FAILED -2
+
+typedef struct bulk_engine bulk_engine;
+
+/**
+ * @brief One command, not null terminated.
+ */
+typedef struct bulk_command
+{
+    const char* data;
+    size_t size;
+} bulk_command;
+
+/**
+ * @brief A formed bulk, valid only during the sink call.
+ */
+typedef struct bulk_view
+{
+    const bulk_command* commands;
+    size_t count;
+    /** The "bulk: a, b, c" line. */
+    const char* text;
+    size_t text_size;
+    /** Time of the first command, in nanoseconds since the epoch. */
+    int64_t timestamp;
+} bulk_view;
+
+typedef void (*bulk_sink_function)(void* context, const bulk_view* bulk);
+
+BULK_EXPORT int bulk_abi_version(void);
+
+/**
+ * @brief Message of the last error on this thread, empty if none.
+ */
+BULK_EXPORT const char* bulk_last_error(void);
+
+/**
+ * @brief Creates an engine from count settings, with the keys and values of the config file.
+ */
+BULK_EXPORT int bulk_engine_create(const char* const* keys, const char* const* values, size_t count,
+    bulk_engine** engine);
+
+/**
+ * @brief Dumps the pending static bulk and frees the engine.
+ */
+BULK_EXPORT void bulk_engine_destroy(bulk_engine* engine);
+
+/**
+ * @brief Registers a function receiving every bulk on the submitting thread.
+ *
+ * Fails with BULK_ERROR_INVALID_ARGUMENT when the engine streams oversized blocks.
+ */
+BULK_EXPORT int bulk_engine_add_sink(bulk_engine* engine, bulk_sink_function sink, void* context);
+
+BULK_EXPORT int bulk_submit(bulk_engine* engine, const char* data, size_t size);
+
+/**
+ * @brief Submits count commands in order.
+ *
+ * Arguments are checked before anything is submitted. Should the engine fail
+ * on a command, however, the commands before it remain submitted.
+ */
+BULK_EXPORT int bulk_submit_batch(bulk_engine* engine, const bulk_command* commands, size_t count);
+
+/**
+ * @brief Submits count commands stored back to back; command i spans
+ * buffer[offsets[i]] up to buffer[offsets[i + 1]], so there are count + 1 offsets.
+ *
+ * Like bulk_submit_batch(), it leaves the commands before a failing one submitted.
+ */
+BULK_EXPORT int bulk_submit_buffer(bulk_engine* engine, const char* buffer, const size_t* offsets, size_t count);
+
+/**
+ * @brief Submits the lines of a buffer; a last line need not end with a newline.
+ *
+ * Like bulk_submit_batch(), it leaves the lines before a failing one submitted.
+ */
+BULK_EXPORT int bulk_submit_lines(bulk_engine* engine, const char* buffer, size_t size);
+
+BULK_EXPORT int bulk_flush(bulk_engine* engine);
+
+BULK_EXPORT int bulk_tick(bulk_engine* engine);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "bulk_c.h"
+
+/**
+ * @brief Interface of sink plugins, shared objects that bulk loads with dlopen.
+ *
+ * A plugin exports bulk_plugin_entry(), returning its description. bulk
+ * calls it from one delivery thread per plugin, which collects the bulks
+ * formed since the previous call into a batch, so a plugin needs no thread
+ * of its own. write() either finishes the batch and returns its status, or
+ * returns BULK_PLUGIN_PENDING and later calls complete() from any thread;
+ * the batch stays valid until then. A few batches may be pending at once,
+ * after which delivery waits for completions. On shutdown all batches are
+ * delivered and completed before close() is called, unless that takes longer
+ * than shutdown-deadline; batches still pending then are abandoned. close()
+ * has to stop any threads of the plugin, as it is unloaded right after, and
+ * complete() must not be called again for a batch already completed.
+ *
+ * Load a plugin with plugin=<path> [<config>]; the rest of the value after
+ * the path is passed to open().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BULK_PLUGIN_ABI_VERSION 1
+
+/** Returned by write() for a batch to be completed later. */
+#define BULK_PLUGIN_PENDING 1
+
+typedef struct bulk_plugin_host
+{
+    void* context;
+    /** Reports the status of a pending batch, BULK_OK or a negative error code. */
+    void (*complete)(void* context, uint64_t sequence, int status);
+} bulk_plugin_host;
+
+typedef struct bulk_plugin
+{
+    /** BULK_PLUGIN_ABI_VERSION the plugin was built with. */
+    uint32_t abi_version;
+    const char* name;
+    /** Creates an instance; host stays valid until close(). */
+    int (*open)(const char* config, const bulk_plugin_host* host, void** instance);
+    /** Delivers count bulks; sequence identifies the batch for complete(). */
+    int (*write)(void* instance, const bulk_view* bulks, size_t count, uint64_t sequence);
+    void (*close)(void* instance);
+} bulk_plugin;
+
+typedef const bulk_plugin* (*bulk_plugin_entry_function)(void);
+
+#define BULK_PLUGIN_ENTRY "bulk_plugin_entry"
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,434 @@
+#include "bulk.h"
+#include "libbulk/batch.h"
+#include "libbulk/input.h"
+#include "libbulk/settings.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace bulk;
+
+namespace
+{
+
+void RunBulk(const SettingsStore& settings, Clock& clock, ReportDirectory& directory,
+    const std::vector<std::string>& inputFiles, const JournalOptions& journalOptions,
+    const std::vector<std::unique_ptr<PluginSink>>& plugins, const ShutdownWatcher& shutdown)
+{
+    auto initialSettings = settings.Get();
+    const auto& reportOptions = initialSettings->Report;
+    if (!journalOptions.Path.empty())
+        RecoverJournal(journalOptions.Path, reportOptions, directory);
+
+    // The journal goes first, as it waits for the last reports to be synced before it is emptied.
+    DurabilityManager durability(reportOptions.Durability, directory.Root());
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<JournalClock> journalClock;
+    std::unique_ptr<JournalMarker> writtenMarker;
+    if (!journalOptions.Path.empty())
+    {
+        journal = std::make_unique<Journal>(journalOptions.Path, journalOptions.Interval, durability);
+        journalClock = std::make_unique<JournalClock>(clock, *journal);
+        writtenMarker = std::make_unique<JournalMarker>(*journal, true);
+    }
+
+    ReportStage reportStage(std::string(), reportOptions, directory, durability, writtenMarker.get(), &settings);
+    PluginTee pluginTee(plugins, reportStage.Get());
+    ConsoleOutput consoleOutput(&pluginTee, reportStage.Degrade());
+    std::unique_ptr<JournalMarker> formedMarker;
+    if (journal)
+        formedMarker = std::make_unique<JournalMarker>(*journal, false, &consoleOutput);
+    BatchCommandProcessor batchCommandProcessor(initialSettings->Flush.BulkSize, journalClock ? *journalClock : clock,
+        formedMarker ? static_cast<CommandProcessor*>(formedMarker.get()) : &consoleOutput, &settings,
+        reportStage.Load());
+    ConsoleInput consoleInput(&batchCommandProcessor);
+    std::unique_ptr<JournalInput> journalInput;
+    if (journal)
+        journalInput = std::make_unique<JournalInput>(*journal, &consoleInput);
+    CommandProcessor& input = journalInput ? static_cast<CommandProcessor&>(*journalInput) : consoleInput;
+
+    if (inputFiles.empty())
+    {
+        ProcessStream(STDIN_FILENO, input, &shutdown);
+        return;
+    }
+
+    for (const auto& inputFile : inputFiles)
+    {
+        if (shutdown.Requested())
+            break;
+        ProcessFile(inputFile, input, &shutdown);
+    }
+}
+
+/**
+ * @brief Processes every input file as an independent stream on a pool of threads.
+ */
+void RunBulkParallel(const SettingsStore& settings, Clock& clock, ReportDirectory& directory,
+    const std::vector<std::string>& inputFiles, size_t jobs, OrderedConsole::Interleave interleave,
+    const std::vector<std::unique_ptr<PluginSink>>& plugins, const ShutdownWatcher& shutdown)
+{
+    auto initialSettings = settings.Get();
+    const auto& reportOptions = initialSettings->Report;
+    DurabilityManager durability(reportOptions.Durability, directory.Root());
+    OrderedConsole console(inputFiles.size(), interleave);
+    std::atomic<size_t> nextFile(0);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    auto worker = [&]()
+    {
+        for (size_t i = nextFile++; i < inputFiles.size(); i = nextFile++)
+        {
+            try
+            {
+                ReportStage reportStage(std::to_string(i), reportOptions, directory, durability, nullptr,
+                    &settings);
+                PluginTee pluginTee(plugins, reportStage.Get());
+                OrderedConsoleOutput consoleOutput(console, i, &pluginTee, reportStage.Degrade());
+                BatchCommandProcessor batchCommandProcessor(initialSettings->Flush.BulkSize, clock, &consoleOutput,
+                    &settings, reportStage.Load());
+                ConsoleInput consoleInput(&batchCommandProcessor);
+                ProcessFile(inputFiles[i], consoleInput, &shutdown);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            console.Finish(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(jobs, inputFiles.size()); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+/**
+ * @brief Splits one input across threads; the settings are not reloaded here.
+ */
+void RunBulkSplit(const SettingsStore& settings, Clock& clock, ReportDirectory& directory,
+    const std::string& inputFile, size_t jobs, const std::vector<std::unique_ptr<PluginSink>>& plugins,
+    const ShutdownWatcher& shutdown)
+{
+    auto initialSettings = settings.Get();
+    const auto& reportOptions = initialSettings->Report;
+    int bulkSize = initialSettings->Flush.BulkSize;
+    DurabilityManager durability(reportOptions.Durability, directory.Root());
+    ReportStage reportStage(std::string(), reportOptions, directory, durability);
+    PluginTee pluginTee(plugins, reportStage.Get());
+    ConsoleOutput consoleOutput(&pluginTee, reportStage.Degrade());
+    SplitBulkFormer splitBulkFormer(bulkSize, clock, jobs, &consoleOutput);
+    MappedFile file(inputFile);
+    splitBulkFormer.Process(file.Data(), shutdown);
+}
+
+/**
+ * @brief Hands bulks to the sinks of a BulkEngine, then to the next processor.
+ */
+class SinkFanout : public CommandProcessor
+{
+public:
+    SinkFanout(CommandProcessor* nextCommandProcessor)
+        : CommandProcessor(nextCommandProcessor)
+    {
+    }
+
+    void AddSink(BulkSink& sink)
+    {
+        mSinks.push_back(&sink);
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        for (auto sink : mSinks)
+            sink->Write(bulk);
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+private:
+    std::vector<BulkSink*> mSinks;
+};
+
+} // namespace
+
+class BulkEngine::Impl
+{
+public:
+    Impl(const Settings& settings)
+        : mClock(CreateClock(settings.Clock))
+        , mSettings(settings.Runtime)
+        , mDirectory(settings.Runtime.Report)
+        , mDurability(settings.Runtime.Report.Durability, mDirectory.Root())
+        , mReportStage(std::string(), settings.Runtime.Report, mDirectory, mDurability, nullptr, &mSettings)
+        , mPlugins(LoadPlugins(settings.Plugins, settings.PluginQueueSize, settings.PluginBackpressure,
+            settings.ShutdownDeadline))
+        , mPluginTee(mPlugins, mReportStage.Get())
+        , mSinkFanout(&mPluginTee)
+        , mBatchCommandProcessor(settings.Runtime.Flush.BulkSize, *mClock, &mSinkFanout, &mSettings,
+            mReportStage.Load())
+        , mConsoleInput(&mBatchCommandProcessor)
+    {
+        const auto& retention = settings.Retention;
+        if (retention.MaxBytes != 0 || retention.MaxFiles != 0 || retention.MaxAge.count() != 0)
+            mRetentionManager = std::make_unique<RetentionManager>(retention, settings.Runtime.Report.Directory,
+                mDirectory);
+        if (settings.Compaction.MinAge.count() != 0)
+            mCompactor = std::make_unique<Compactor>(settings.Compaction, settings.Runtime.Report.Directory);
+    }
+
+    std::unique_ptr<Clock> mClock;
+    SettingsStore mSettings;
+    ReportDirectory mDirectory;
+    DurabilityManager mDurability;
+    ReportStage mReportStage;
+    std::vector<std::unique_ptr<PluginSink>> mPlugins;
+    PluginTee mPluginTee;
+    SinkFanout mSinkFanout;
+    BatchCommandProcessor mBatchCommandProcessor;
+    ConsoleInput mConsoleInput;
+    std::unique_ptr<RetentionManager> mRetentionManager;
+    std::unique_ptr<Compactor> mCompactor;
+};
+
+BulkEngine::BulkEngine(const std::map<std::string, std::string>& settings)
+{
+    Settings engineSettings;
+    for (const auto& setting : settings)
+    {
+        if (!ApplySetting(setting.first, setting.second, engineSettings))
+            throw std::invalid_argument("Unknown setting " + setting.first);
+    }
+    ValidateSettings(engineSettings);
+    if (engineSettings.Jobs != 0 || !engineSettings.Journal.Path.empty() || engineSettings.MemoryLimit != 0)
+        throw std::invalid_argument("jobs, journal and memory-limit are not supported by BulkEngine");
+    mImpl = std::make_unique<Impl>(engineSettings);
+}
+
+BulkEngine::~BulkEngine() = default;
+
+void BulkEngine::AddSink(BulkSink& sink)
+{
+    if (mImpl->mSettings.Get()->Flush.OversizedBlock == BlockOverflow::Stream)
+        throw std::invalid_argument("block-overflow=stream is not supported with sinks");
+    mImpl->mSinkFanout.AddSink(sink);
+}
+
+void BulkEngine::Submit(std::string_view command)
+{
+    mImpl->mConsoleInput.ProcessCommand(Command{command, {}});
+}
+
+void BulkEngine::SubmitLines(std::string_view lines)
+{
+    ProcessLines(lines, mImpl->mConsoleInput);
+}
+
+void BulkEngine::Flush()
+{
+    mImpl->mBatchCommandProcessor.Flush();
+}
+
+void BulkEngine::Tick()
+{
+    mImpl->mConsoleInput.Tick();
+}
+
+int BulkCommandLine(int argc, char const** argv)
+{
+    try
+    {
+        if (argc < 2)
+        {
+            std::cerr << "Bulk size is not specified." << std::endl;
+            return 1;
+        }
+
+        if (std::string(argv[1]) == "--cat")
+        {
+            std::string dictionary;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                if (arg.compare(0, 13, "--dictionary=") == 0)
+                    dictionary = std::string(MappedFile(arg.substr(13)).Data());
+                else
+                    PrintReport(MappedFile(arg).Data(), dictionary, std::cout);
+            }
+            return 0;
+        }
+
+        if (std::string(argv[1]).compare(0, 9, "--lookup=") == 0)
+        {
+            auto timestamp = ParseNumber("lookup", argv[1] + 9, 0, LLONG_MAX);
+            std::string dictionary;
+            std::vector<std::string> roots;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                if (arg.compare(0, 13, "--dictionary=") == 0)
+                    dictionary = std::string(MappedFile(arg.substr(13)).Data());
+                else
+                    roots.push_back(arg);
+            }
+            if (roots.empty())
+                roots.emplace_back();
+
+            size_t found = 0;
+            for (const auto& root : roots)
+                found += LookupBulks(root, timestamp, dictionary, std::cout);
+            if (found == 0)
+            {
+                std::cerr << "No bulk at " << timestamp << "." << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+
+        if (std::string(argv[1]).compare(0, 19, "--train-dictionary=") == 0)
+        {
+#ifdef BULK_WITH_ZSTD
+            std::vector<std::string> sampleFiles(argv + 2, argv + argc);
+            auto dictionary = TrainDictionary(sampleFiles, 112640);
+            close(WriteFile(argv[1] + 19, dictionary, false));
+            return 0;
+#else
+            std::cerr << "Dictionary training requires zstd support." << std::endl;
+            return 1;
+#endif
+        }
+
+        std::string configPath;
+        bool printSettings = false;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "--help") == 0)
+            {
+                PrintUsage(std::cout);
+                return 0;
+            }
+            if (strcmp(argv[i], "--print-settings") == 0)
+                printSettings = true;
+            else if (strncmp(argv[i], "--config=", 9) == 0)
+                configPath = argv[i] + 9;
+        }
+
+        Settings settings;
+        if (!configPath.empty())
+            LoadSettings(configPath, settings);
+        std::vector<std::string> inputFiles;
+        ApplyArguments(argc, argv, settings, &inputFiles);
+
+        ValidateSettings(settings);
+        if (printSettings)
+        {
+            PrintSettings(settings, std::cout);
+            return 0;
+        }
+
+        auto clock = CreateClock(settings.Clock);
+        SettingsStore settingsStore(settings.Runtime);
+        std::function<void()> reload;
+        if (!configPath.empty())
+        {
+            // Settings are rebuilt as at startup, so that the command line
+            // still overrides the file; only the runtime ones take effect.
+            reload = [&settingsStore, &configPath, argc, argv]()
+            {
+                Settings reloaded;
+                try
+                {
+                    LoadSettings(configPath, reloaded);
+                    ApplyArguments(argc, argv, reloaded, nullptr);
+                    ValidateSettings(reloaded);
+                    settingsStore.Set(reloaded.Runtime);
+                    std::cerr << "Reloaded " << configPath << std::endl;
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << e.what() << "; keeping the current settings." << std::endl;
+                }
+            };
+        }
+
+        // Splitting one input reproduces count based bulks only and needs the
+        // whole of it mapped; otherwise a single input is one stream, processed
+        // as without jobs.
+        const auto& flush = settings.Runtime.Flush;
+        bool splittable = flush.BulkBytes == 0 && flush.TimeLimit.count() == 0 && flush.MaxBulkSize == 0 &&
+            flush.OversizedBlock == BlockOverflow::Keep;
+        ShutdownWatcher shutdownWatcher(settings.ShutdownDeadline, reload);
+        // Shared by the writers and retention, which keeps the files they have open.
+        ReportDirectory directory(settings.Runtime.Report);
+        const auto& retention = settings.Retention;
+        std::unique_ptr<RetentionManager> retentionManager;
+        if (retention.MaxBytes != 0 || retention.MaxFiles != 0 || retention.MaxAge.count() != 0)
+        {
+            retentionManager = std::make_unique<RetentionManager>(retention, settings.Runtime.Report.Directory,
+                directory);
+        }
+        std::unique_ptr<Compactor> compactor;
+        if (settings.Compaction.MinAge.count() != 0)
+            compactor = std::make_unique<Compactor>(settings.Compaction, settings.Runtime.Report.Directory);
+        MemoryAccountant::Instance().SetLimit(settings.MemoryLimit);
+        auto plugins = LoadPlugins(settings.Plugins, settings.PluginQueueSize, settings.PluginBackpressure,
+            settings.ShutdownDeadline);
+        if (settings.Jobs > 1 && inputFiles.size() == 1 && splittable && MappedFile::Mappable(inputFiles[0]))
+            RunBulkSplit(settingsStore, *clock, directory, inputFiles[0], settings.Jobs, plugins, shutdownWatcher);
+        else if (settings.Jobs != 0 && inputFiles.size() > 1)
+        {
+            RunBulkParallel(settingsStore, *clock, directory, inputFiles, settings.Jobs, settings.Interleave, plugins,
+                shutdownWatcher);
+        }
+        else
+            RunBulk(settingsStore, *clock, directory, inputFiles, settings.Journal, plugins, shutdownWatcher);
+        // Waits for the plugins to complete every batch.
+        plugins.clear();
+
+        if (settings.Metrics)
+        {
+            rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) == 0)
+                Metrics::Instance().Get("memory.rss.peak_kb") = static_cast<uint64_t>(usage.ru_maxrss);
+            Metrics::Instance().Print(std::cerr);
+        }
+        return 0;
+    }
+    catch (const std::invalid_argument& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,619 @@
+#pragma once
+
+#include "core.h"
+#include "records.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bulk
+{
+
+enum class Overflow
+{
+    Block,
+    Drop,
+    Sample,
+    Spill
+};
+
+/**
+ * @brief What a queued sink does with a bulk it cannot take at once, because
+ * its queue is full or, with Rate set, its token bucket is empty.
+ *
+ * Block waits, Drop discards the bulk and Sample discards all but every
+ * SampleEvery-th, for which it waits. Spill, for queues without a rate,
+ * appends bulks beyond a full queue to a file in SpillDirectory and feeds
+ * them back in order once the sink catches up.
+ */
+struct BackpressureOptions
+{
+    Overflow Mode = Overflow::Block;
+    size_t SampleEvery = 10;
+    // Bulks per second, 0 for no limit.
+    size_t Rate = 0;
+    // Bulks that may pass at once after a quiet period, Rate if 0.
+    size_t Burst = 0;
+    // The report directory if empty.
+    std::string SpillDirectory;
+};
+
+/**
+ * @brief Token bucket holding up to Burst tokens, refilled at Rate per second.
+ */
+class TokenBucket
+{
+public:
+    TokenBucket(size_t rate, size_t burst)
+        : mRate(static_cast<double>(rate))
+        , mBurst(static_cast<double>(burst ? burst : rate))
+        , mTokens(mBurst)
+        , mUpdated(std::chrono::steady_clock::now())
+    {
+    }
+
+    /**
+     * @return Zero if a token is available, otherwise the time until there is one.
+     */
+    std::chrono::nanoseconds Wait()
+    {
+        auto now = std::chrono::steady_clock::now();
+        mTokens = std::min(mBurst, mTokens + std::chrono::duration<double>(now - mUpdated).count() * mRate);
+        mUpdated = now;
+        if (mTokens >= 1)
+            return std::chrono::nanoseconds(0);
+        return std::chrono::nanoseconds(static_cast<int64_t>((1 - mTokens) / mRate * 1e9) + 1);
+    }
+
+    void Take()
+    {
+        mTokens -= 1;
+    }
+
+private:
+    double mRate;
+    double mBurst;
+    double mTokens;
+    std::chrono::steady_clock::time_point mUpdated;
+};
+
+/**
+ * @brief Applies BackpressureOptions to the producers of a bounded queue and
+ * counts <name>.blocked, <name>.dropped and <name>.sampled.
+ *
+ * A queue also counts as full while it holds anything and the memory limit
+ * is exceeded.
+ *
+ * Callers hold the queue mutex; the consumer notifies space whenever it
+ * takes bulks out of the queue.
+ */
+class Backpressure
+{
+public:
+    /**
+     * @param capacity Bulks the queue holds, 0 for no limit.
+     */
+    Backpressure(const BackpressureOptions& options, size_t capacity, const std::string& name)
+        : mOptions(options)
+        , mCapacity(capacity)
+        , mBucket(options.Rate ? std::make_unique<TokenBucket>(options.Rate, options.Burst) : nullptr)
+        , mOverflows(0)
+        , mOverloaded(false)
+        , mBlocked(Metrics::Instance().Get(name + ".blocked"))
+        , mDropped(Metrics::Instance().Get(name + ".dropped"))
+        , mSampled(Metrics::Instance().Get(name + ".sampled"))
+    {
+    }
+
+    /**
+     * @brief Decides on the next bulk, waiting if the policy says so.
+     *
+     * @param queued Returns the bulks in the queue.
+     * @param consumer Woken before waiting for space.
+     * @return False if the bulk is to be discarded.
+     */
+    template <typename Queued>
+    bool Admit(std::unique_lock<std::mutex>& lock, std::condition_variable& consumer,
+        std::condition_variable& space, Queued queued)
+    {
+        auto full = [&]()
+        {
+            size_t size = queued();
+            return (mCapacity != 0 && size >= mCapacity) || (size != 0 && MemoryAccountant::Instance().OverLimit());
+        };
+        bool overloaded = full() || (mBucket && mBucket->Wait().count() != 0);
+        mOverloaded = overloaded;
+        if (overloaded)
+        {
+            if (mOptions.Mode == Overflow::Drop ||
+                (mOptions.Mode == Overflow::Sample && ++mOverflows % mOptions.SampleEvery != 0))
+            {
+                ++mDropped;
+                return false;
+            }
+            ++(mOptions.Mode == Overflow::Sample ? mSampled : mBlocked);
+        }
+
+        for (;;)
+        {
+            if (full())
+            {
+                consumer.notify_all();
+                space.wait(lock, [&]() { return !full(); });
+            }
+            auto wait = mBucket ? mBucket->Wait() : std::chrono::nanoseconds(0);
+            if (wait.count() == 0)
+                break;
+            lock.unlock();
+            std::this_thread::sleep_for(wait);
+            lock.lock();
+        }
+        if (mBucket)
+            mBucket->Take();
+        return true;
+    }
+
+    /**
+     * @brief Whether the last bulk found the queue full or the bucket empty.
+     */
+    bool Overloaded() const
+    {
+        return mOverloaded;
+    }
+
+private:
+    BackpressureOptions mOptions;
+    size_t mCapacity;
+    std::unique_ptr<TokenBucket> mBucket;
+    size_t mOverflows;
+    bool mOverloaded;
+    std::atomic<uint64_t>& mBlocked;
+    std::atomic<uint64_t>& mDropped;
+    std::atomic<uint64_t>& mSampled;
+};
+
+/**
+ * @brief Load of the sinks behind an AsyncProcessor: the bulks not yet
+ * processed and the average time spent on one.
+ */
+class SinkLoad
+{
+public:
+    void Enqueued()
+    {
+        mDepth.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @param latency Time spent on all count bulks.
+     */
+    void Processed(size_t count, std::chrono::nanoseconds latency)
+    {
+        mDepth.fetch_sub(count, std::memory_order_relaxed);
+        mLatency.store(Average(mLatency.load(std::memory_order_relaxed), latency.count() / count),
+            std::memory_order_relaxed);
+    }
+
+    size_t Depth() const
+    {
+        return mDepth.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds Latency() const
+    {
+        return std::chrono::nanoseconds(mLatency.load(std::memory_order_relaxed));
+    }
+
+    void SetOverloaded(bool overloaded)
+    {
+        mOverloaded.store(overloaded, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Whether the last bulk offered found the queue full or over its rate.
+     */
+    bool Overloaded() const
+    {
+        return mOverloaded.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Moving average weighting the sample by 1/8, so that a single slow
+     * write does not swing it.
+     */
+    static uint64_t Average(uint64_t average, uint64_t sample)
+    {
+        return average ? average - average / 8 + sample / 8 : sample;
+    }
+
+private:
+    std::atomic<size_t> mDepth{0};
+    std::atomic<uint64_t> mLatency{0};
+    std::atomic<bool> mOverloaded{false};
+};
+
+/**
+ * @brief Append-only file of binary bulk records that a queue overflows into
+ * and reads back in order.
+ *
+ * The file is created in the given directory when the first bulk is
+ * appended and unlinked right away, so that nothing is left behind; it is
+ * truncated whenever it has been read to the end. Appending and reading may
+ * happen on different threads; they take a lock of the file's own, while
+ * Empty() takes none.
+ */
+class SpillFile
+{
+public:
+    /**
+     * @param name Prefix of the metrics.
+     */
+    SpillFile(const std::string& directory, const std::string& name)
+        : mDirectory(directory.empty() ? "." : directory)
+        , mFd(-1)
+        , mBegin(0)
+        , mEnd(0)
+        , mSpilled(Metrics::Instance().Get(name + ".spilled"))
+        , mMaxBytes(Metrics::Instance().Get(name + ".spill_bytes.max"))
+    {
+    }
+
+    ~SpillFile()
+    {
+        if (mFd != -1)
+            close(mFd);
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    bool Empty() const
+    {
+        return mBegin.load() == mEnd.load();
+    }
+
+    void Append(const Bulk& bulk)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFd == -1)
+            mFd = CreateTemporaryFile(mDirectory, "spill");
+
+        mRecord.clear();
+        EncodeBulkRecord(bulk, mRecord);
+        for (size_t written = 0; written < mRecord.size(); )
+        {
+            ssize_t result = pwrite(mFd, mRecord.data() + written, mRecord.size() - written, mEnd + written);
+            if (result == -1 && errno != EINTR)
+                throw std::runtime_error(std::string("Cannot write the spill file: ") + strerror(errno));
+            written += result == -1 ? 0 : result;
+        }
+        mEnd += mRecord.size();
+        ++mSpilled;
+        Metrics::Max(mMaxBytes, mEnd - mBegin);
+    }
+
+    /**
+     * @brief Reads the oldest whole records, about limit bytes of them but at least one.
+     */
+    void Read(std::string& records, size_t limit)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        records.resize(std::min<uint64_t>(std::max(limit, sizeof(BulkRecordHeader)), mEnd - mBegin));
+        ReadAt(&records[0], records.size(), mBegin);
+        size_t whole = 0;
+        while (whole + sizeof(BulkRecordHeader) <= records.size())
+        {
+            BulkRecordHeader header;
+            memcpy(&header, records.data() + whole, sizeof(header));
+            if (whole + header.Size > records.size())
+            {
+                if (whole == 0)
+                {
+                    size_t read = records.size();
+                    records.resize(header.Size);
+                    ReadAt(&records[read], header.Size - read, mBegin + read);
+                    whole = header.Size;
+                }
+                break;
+            }
+            whole += header.Size;
+        }
+        records.resize(whole);
+
+        mBegin += whole;
+        if (mBegin == mEnd)
+            Truncate();
+    }
+
+    /**
+     * @brief Empties the file.
+     */
+    void Discard()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Truncate();
+    }
+
+private:
+    void Truncate()
+    {
+        mBegin = mEnd = 0;
+        if (ftruncate(mFd, 0) == -1)
+            std::cerr << "Cannot truncate the spill file: " << strerror(errno) << std::endl;
+    }
+
+    void ReadAt(char* data, size_t size, uint64_t offset)
+    {
+        while (size != 0)
+        {
+            ssize_t result = pread(mFd, data, size, offset);
+            if (result == -1 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                throw std::runtime_error(std::string("Cannot read the spill file: ") + strerror(errno));
+            data += result;
+            size -= result;
+            offset += result;
+        }
+    }
+
+    std::string mDirectory;
+    std::mutex mMutex;
+    int mFd;
+    std::atomic<uint64_t> mBegin;
+    std::atomic<uint64_t> mEnd;
+    std::string mRecord;
+    std::atomic<uint64_t>& mSpilled;
+    std::atomic<uint64_t>& mMaxBytes;
+};
+
+/**
+ * @brief Hands bulks over to a worker thread that feeds the next processor.
+ *
+ * Sinks behind it, such as a compressing ReportWriter, run off the reader
+ * thread. A full queue blocks the reader, sheds bulks or spills them, as the
+ * backpressure options say. While anything is spilled, new bulks are
+ * spilled too, so that the worker, which drains the queue before the spill
+ * file, keeps their order. The spill file is written and read without the
+ * queue lock held; should writing it fail, the reader waits for the spill
+ * file to drain and the queue to have room instead, as with Overflow::Block.
+ */
+class AsyncProcessor : public CommandProcessor
+{
+public:
+    /**
+     * @param load Tracks the queue and the time the next processor takes, if not null.
+     * @param capacity Bulks that may wait, 0 for no limit.
+     * @param name Prefix of the backpressure metrics.
+     */
+    AsyncProcessor(CommandProcessor* nextCommandProcessor, SinkLoad* load = nullptr, size_t capacity = 0,
+        const BackpressureOptions& backpressure = BackpressureOptions(), const std::string& name = "queue")
+        : CommandProcessor(nextCommandProcessor)
+        , mLoad(load)
+        , mCapacity(capacity)
+        , mBackpressure(backpressure, capacity, name)
+        , mSpill(backpressure.Mode == Overflow::Spill ?
+            std::make_unique<SpillFile>(backpressure.SpillDirectory, name) : nullptr)
+        , mSpillFailures(Metrics::Instance().Get(name + ".spill_failures"))
+        , mSpillFailing(false)
+        , mBusy(false)
+        , mStopped(false)
+        , mThread([this]() { Run(); })
+    {
+    }
+
+    ~AsyncProcessor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mCondition.notify_one();
+        mThread.join();
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        ProcessBulks(&bulk, 1);
+    }
+
+    void ProcessBulks(const Bulk* bulks, size_t count) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (mSpill)
+                {
+                    bool spill = !mSpill->Empty() || mQueue.size() >= mCapacity ||
+                        (!mQueue.empty() && MemoryAccountant::Instance().OverLimit());
+                    if (spill)
+                        Spill(lock, bulks[i]);
+                    else
+                        Enqueue(bulks[i]);
+                    if (mLoad)
+                    {
+                        mLoad->SetOverloaded(spill);
+                        mLoad->Enqueued();
+                    }
+                    continue;
+                }
+
+                bool admitted = mBackpressure.Admit(lock, mCondition, mSpace, [this]() { return mQueue.size(); });
+                if (mLoad)
+                    mLoad->SetOverloaded(mBackpressure.Overloaded());
+                if (!admitted)
+                    continue;
+                Enqueue(bulks[i]);
+                if (mLoad)
+                    mLoad->Enqueued();
+            }
+        }
+        mCondition.notify_one();
+    }
+
+    /**
+     * @brief Waits for everything queued and spilled to be processed, then
+     * streams on this thread, as a stream is too large to queue.
+     */
+    void StartStream(std::chrono::system_clock::time_point timestamp) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.notify_one();
+            mSpace.wait(lock, [this]() { return mQueue.empty() && !mBusy && (!mSpill || mSpill->Empty()); });
+        }
+        CommandProcessor::StartStream(timestamp);
+    }
+
+private:
+    void Enqueue(const Bulk& bulk)
+    {
+        mQueue.push_back(bulk);
+        MemoryAccountant::Instance().Add(MemoryAccountant::Pool::Queue, MemoryUsage(bulk));
+    }
+
+    /**
+     * @brief Appends the bulk to the spill file with the queue unlocked, or
+     * queues it once there is room if that fails.
+     */
+    void Spill(std::unique_lock<std::mutex>& lock, const Bulk& bulk)
+    {
+        lock.unlock();
+        try
+        {
+            mSpill->Append(bulk);
+            lock.lock();
+            mSpillFailing = false;
+            return;
+        }
+        catch (const std::exception& e)
+        {
+            ++mSpillFailures;
+            if (!mSpillFailing)
+                std::cerr << e.what() << "; waiting for the queue instead." << std::endl;
+        }
+        lock.lock();
+        mSpillFailing = true;
+        mCondition.notify_one();
+        mSpace.wait(lock, [this]() { return mSpill->Empty() && mQueue.size() < mCapacity; });
+        Enqueue(bulk);
+    }
+
+    /**
+     * @brief Passes everything queued since the last wakeup to the next
+     * processor as one batch, then what was spilled, a slice at a time.
+     */
+    void Run()
+    {
+        std::vector<Bulk> bulks;
+        std::string records;
+        for (;;)
+        {
+            bool spilled = false;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]()
+                {
+                    return mStopped || !mQueue.empty() || (mSpill && !mSpill->Empty());
+                });
+                if (!mQueue.empty())
+                    bulks.swap(mQueue);
+                else if (mSpill && !mSpill->Empty())
+                    spilled = true;
+                else
+                    return;
+                mBusy = true;
+            }
+            mSpace.notify_one();
+            if (spilled)
+                ReadSpill(records);
+
+            auto started = std::chrono::steady_clock::now();
+            try
+            {
+                if (!records.empty())
+                {
+                    DecodeBulkRecords(records, [&bulks](const Bulk& bulk)
+                    {
+                        bulks.push_back(bulk);
+                        bulks.back().Text = FormatBulk(bulk);
+                    });
+                }
+                if (mNextCommandProcessor)
+                    mNextCommandProcessor->ProcessBulks(bulks.data(), bulks.size());
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+            if (mLoad && !bulks.empty())
+                mLoad->Processed(bulks.size(), std::chrono::steady_clock::now() - started);
+            if (records.empty())
+            {
+                size_t bytes = 0;
+                for (const auto& bulk : bulks)
+                    bytes += MemoryUsage(bulk);
+                MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Queue, bytes);
+            }
+            bulks.clear();
+            records.clear();
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mBusy = false;
+            }
+            mSpace.notify_one();
+        }
+    }
+
+    /**
+     * @brief Reads the next slice of the spill file; if that fails, the spilled bulks are lost.
+     */
+    void ReadSpill(std::string& records)
+    {
+        try
+        {
+            mSpill->Read(records, SpillSliceSize);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            mSpill->Discard();
+        }
+    }
+
+    static constexpr size_t SpillSliceSize = 1024 * 1024;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::condition_variable mSpace;
+    std::vector<Bulk> mQueue;
+    SinkLoad* mLoad;
+    size_t mCapacity;
+    Backpressure mBackpressure;
+    std::unique_ptr<SpillFile> mSpill;
+    std::atomic<uint64_t>& mSpillFailures;
+    // Appending to the spill file failed the last time it was tried.
+    bool mSpillFailing;
+    // The worker is processing a batch taken off the queue or the spill file.
+    bool mBusy;
+    bool mStopped;
+    std::thread mThread;
+};
+
+} // namespace bulk
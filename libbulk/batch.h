@@ -0,0 +1,350 @@
+#pragma once
+
+#include "clock.h"
+#include "runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+
+namespace bulk
+{
+
+class BatchCommandProcessor : public CommandProcessor
+{
+public:
+    /**
+     * @param settings Flush policy to follow, reloaded at bulk boundaries; if
+     * null, bulks are dumped every bulkSize commands.
+     * @param load Queue of the sinks, used by adaptive sizing next to the
+     * time the next processor takes; may be null.
+     */
+    BatchCommandProcessor(int bulkSize, Clock& clock, CommandProcessor* nextCommandProcessor,
+        const SettingsStore* settings = nullptr, const SinkLoad* load = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mClock(clock)
+        , mBulkSize(bulkSize)
+        , mBatchBytes(0)
+        , mUnaccountedBytes(0)
+        , mAccountedBytes(0)
+        , mBlockForced(false)
+        , mRejecting(false)
+        , mStreaming(false)
+        , mSettings(settings)
+        , mSettingsVersion(0)
+        , mLoad(load)
+        , mSinkLatency(0)
+        , mBulkSizeGauge(Metrics::Instance().Get("batch.bulk_size"))
+        , mBulkSizeMax(Metrics::Instance().Get("batch.bulk_size.max"))
+        , mResizes(Metrics::Instance().Get("batch.resizes"))
+        , mSplitBlocks(Metrics::Instance().Get("batch.split_blocks"))
+        , mRejectedBlocks(Metrics::Instance().Get("batch.rejected_blocks"))
+        , mStreamedBlocks(Metrics::Instance().Get("batch.streamed_blocks"))
+        , mHeldBytes(0)
+    {
+        mPolicy.BulkSize = bulkSize;
+        Reconfigure();
+    }
+
+    ~BatchCommandProcessor()
+    {
+        if (!mBlockForced)
+            DumpBatch();
+        else if (mStreaming && mNextCommandProcessor)
+            mNextCommandProcessor->FinishStream(false);
+        DropPart();
+        ClearBatch();
+    }
+
+    void StartBlock() override
+    {
+        mBlockForced = true;
+        mRejecting = false;
+        DumpBatch();
+    }
+
+    void FinishBlock() override
+    {
+        mBlockForced = false;
+        if (mRejecting)
+            mRejecting = false;
+        else if (mStreaming)
+        {
+            StreamBatch();
+            mStreaming = false;
+            if (mNextCommandProcessor)
+                mNextCommandProcessor->FinishStream(true);
+        }
+        else
+        {
+            // A held part is only ever followed by an empty batch, so it is the last one.
+            PassPart(false);
+            DumpBatch();
+        }
+    }
+
+    void ProcessCommand(const Command& command) override
+    {
+        if (mRejecting)
+            return;
+        PassPart(true);
+
+        if (mCommandBatch.empty())
+        {
+            Reconfigure();
+            mBatchTimestamp = mClock.Now();
+            if (mPolicy.TimeLimit.count() != 0 || mPolicy.MaxBulkSize != 0)
+                mBatchStarted = std::chrono::steady_clock::now();
+        }
+        mCommandBatch.push_back(command.Text);
+        mBatchBytes += command.Text.size();
+        mUnaccountedBytes += sizeof(uint64_t) + command.Text.size();
+        if (mUnaccountedBytes >= AccountingGranularity)
+            Account();
+
+        if (!mBlockForced && (mCommandBatch.size() >= static_cast<size_t>(mBulkSize) || Oversized() || Expired()))
+        {
+            DumpStatic();
+        }
+        else if (mStreaming)
+        {
+            if (mBatchBytes >= AccountingGranularity)
+                StreamBatch();
+        }
+        else if (mBlockForced && mPolicy.OversizedBlock != BlockOverflow::Keep && OversizedBlock())
+        {
+            if (mPolicy.OversizedBlock == BlockOverflow::Split)
+            {
+                ++mSplitBlocks;
+                HoldPart();
+            }
+            else if (mPolicy.OversizedBlock == BlockOverflow::Stream)
+            {
+                ++mStreamedBlocks;
+                mStreaming = true;
+                if (mNextCommandProcessor)
+                    mNextCommandProcessor->StartStream(mBatchTimestamp);
+                StreamBatch();
+            }
+            else
+            {
+                ++mRejectedBlocks;
+                std::cerr << "Rejected an oversized block after " << mBatchBytes << " bytes" << std::endl;
+                ClearBatch();
+                mRejecting = true;
+            }
+        }
+    }
+
+    void Tick() override
+    {
+        if (!mBlockForced && !mCommandBatch.empty() && Expired())
+            DumpStatic();
+    }
+
+    /**
+     * @brief Dumps the static bulk collected so far.
+     */
+    void Flush()
+    {
+        if (!mBlockForced)
+            DumpBatch();
+    }
+
+private:
+    void Reconfigure()
+    {
+        if (!mSettings || mSettings->Version() == mSettingsVersion)
+            return;
+        auto settings = mSettings->Get(mSettingsVersion);
+        mPolicy = settings->Flush;
+        if (mPolicy.MaxBulkSize == 0)
+            Resize(mPolicy.BulkSize);
+        else
+            Resize(std::clamp(mBulkSize, mPolicy.MinBulkSize, mPolicy.MaxBulkSize));
+    }
+
+    bool Oversized() const
+    {
+        return mPolicy.BulkBytes != 0 && mBatchBytes >= mPolicy.BulkBytes;
+    }
+
+    bool OversizedBlock() const
+    {
+        // Over the memory limit, blocks too small to matter are left alone.
+        return (mPolicy.BlockBytes != 0 && mBatchBytes >= mPolicy.BlockBytes) ||
+            (mBatchBytes >= AccountingGranularity && MemoryAccountant::Instance().OverLimit());
+    }
+
+    /**
+     * @brief Reports the batch to MemoryAccountant, in steps of AccountingGranularity
+     * so that threads forming bulks do not contend on it for every command.
+     */
+    void Account()
+    {
+        MemoryAccountant::Instance().Add(MemoryAccountant::Pool::Batch, mUnaccountedBytes);
+        mAccountedBytes += mUnaccountedBytes;
+        mUnaccountedBytes = 0;
+    }
+
+    bool Expired() const
+    {
+        return mPolicy.TimeLimit.count() != 0 &&
+            std::chrono::steady_clock::now() - mBatchStarted >= mPolicy.TimeLimit;
+    }
+
+    void DumpStatic()
+    {
+        if (mPolicy.MaxBulkSize == 0)
+        {
+            DumpBatch();
+            return;
+        }
+
+        auto dumped = std::chrono::steady_clock::now();
+        DumpBatch();
+        Adapt(dumped - mBatchStarted, std::chrono::steady_clock::now() - dumped);
+    }
+
+    /**
+     * @brief Picks the size of the next static bulk.
+     *
+     * The sinks fall behind when bulks queue up in front of them or take longer
+     * to write than to fill; larger bulks then spread the per-file cost over
+     * more commands. Otherwise, if a command waited longer than the target
+     * latency, the size shrinks by a quarter so that bulks are dumped sooner.
+     * A sink slower than the target on its own thus still gets the largest bulks.
+     */
+    void Adapt(std::chrono::nanoseconds fill, std::chrono::nanoseconds sink)
+    {
+        mSinkLatency = SinkLoad::Average(mSinkLatency, sink.count());
+        auto latency = std::chrono::nanoseconds(mSinkLatency);
+        if (mLoad)
+            latency = std::max(latency, mLoad->Latency());
+
+        if ((mLoad && mLoad->Depth() > 1) || latency > fill)
+            Resize(static_cast<int>(std::min<long long>(2LL * mBulkSize, mPolicy.MaxBulkSize)));
+        else if (fill + latency > mPolicy.TargetLatency)
+            Resize(std::max(mBulkSize - std::max(mBulkSize / 4, 1), mPolicy.MinBulkSize));
+    }
+
+    void Resize(int bulkSize)
+    {
+        if (bulkSize != mBulkSize)
+            mResizes.fetch_add(1, std::memory_order_relaxed);
+        mBulkSize = bulkSize;
+        mBulkSizeGauge.store(bulkSize, std::memory_order_relaxed);
+        Metrics::Max(mBulkSizeMax, bulkSize);
+    }
+
+    void ClearBatch()
+    {
+        // The batch keeps its buffers for the next bulk, unless an oversized block grew them.
+        if (mBatchBytes > KeptBatchBytes)
+            mCommandBatch = CommandList();
+        else
+            mCommandBatch.clear();
+        mBatchBytes = 0;
+        MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Batch, mAccountedBytes);
+        mAccountedBytes = 0;
+        mUnaccountedBytes = 0;
+    }
+
+    void DumpBatch()
+    {
+        if (mNextCommandProcessor && !mCommandBatch.empty())
+        {
+            Bulk bulk{std::move(mCommandBatch), std::string(), mBatchTimestamp, false};
+            bulk.Text = FormatBulk(bulk);
+            mNextCommandProcessor->ProcessBulk(bulk);
+            mCommandBatch = std::move(bulk.Commands);
+        }
+        ClearBatch();
+    }
+
+    /**
+     * @brief Sets the batch aside as a part of a split block, to be passed on
+     * once a further command or the end of the block tells whether it is the
+     * last part; the end of input discards it with the rest of the block.
+     */
+    void HoldPart()
+    {
+        mHeldPart = Bulk{std::move(mCommandBatch), std::string(), mBatchTimestamp, false};
+        // The part stays accounted as batch memory until it is passed on.
+        Account();
+        mHeldBytes = mAccountedBytes;
+        mAccountedBytes = 0;
+        ClearBatch();
+    }
+
+    /**
+     * @param continued Whether more of the block follows the held part.
+     */
+    void PassPart(bool continued)
+    {
+        if (mHeldPart.Commands.empty())
+            return;
+        mHeldPart.Continued = continued;
+        mHeldPart.Text = FormatBulk(mHeldPart);
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(mHeldPart);
+        DropPart();
+    }
+
+    void DropPart()
+    {
+        mHeldPart = Bulk();
+        MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Batch, mHeldBytes);
+        mHeldBytes = 0;
+    }
+
+    /**
+     * @brief Passes the commands collected so far to the bulk being streamed.
+     */
+    void StreamBatch()
+    {
+        if (mNextCommandProcessor && !mCommandBatch.empty())
+            mNextCommandProcessor->StreamCommands(mCommandBatch);
+        ClearBatch();
+    }
+
+    // Also the size of the slices in which an oversized block is streamed.
+    static constexpr size_t AccountingGranularity = 64 * 1024;
+    static constexpr size_t KeptBatchBytes = 1024 * 1024;
+
+    Clock& mClock;
+    int mBulkSize;
+    size_t mBatchBytes;
+    size_t mUnaccountedBytes;
+    size_t mAccountedBytes;
+    FlushPolicy mPolicy;
+    bool mBlockForced;
+    // Skipping the rest of a rejected block.
+    bool mRejecting;
+    // Passing an oversized block on in slices.
+    bool mStreaming;
+    const SettingsStore* mSettings;
+    uint64_t mSettingsVersion;
+    const SinkLoad* mLoad;
+    uint64_t mSinkLatency;
+    // Shared by every stream processed in parallel; the gauge holds the size
+    // the last of them resized to, the maximum is that of all streams.
+    std::atomic<uint64_t>& mBulkSizeGauge;
+    std::atomic<uint64_t>& mBulkSizeMax;
+    std::atomic<uint64_t>& mResizes;
+    std::atomic<uint64_t>& mSplitBlocks;
+    std::atomic<uint64_t>& mRejectedBlocks;
+    std::atomic<uint64_t>& mStreamedBlocks;
+    CommandList mCommandBatch;
+    std::chrono::system_clock::time_point mBatchTimestamp;
+    std::chrono::steady_clock::time_point mBatchStarted;
+    // Last part of a split block so far, empty if none.
+    Bulk mHeldPart;
+    size_t mHeldBytes;
+};
+
+} // namespace bulk
@@ -0,0 +1,119 @@
+#include "clock.h"
+
+#include <time.h>
+
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace bulk
+{
+
+class SystemClock : public Clock
+{
+public:
+    std::chrono::system_clock::time_point Now() override
+    {
+        return std::chrono::system_clock::now();
+    }
+};
+
+/**
+ * @brief CLOCK_REALTIME_COARSE, resolution of a scheduler tick.
+ *
+ * Still read through the vDSO, but from the time kept at the last tick, so
+ * that no hardware counter is read.
+ */
+class CoarseClock : public Clock
+{
+public:
+    std::chrono::system_clock::time_point Now() override
+    {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+    }
+};
+
+/**
+ * @brief Wall clock extrapolated from the time stamp counter.
+ *
+ * Calibrated once against system_clock at construction, so it drifts with the
+ * TSC and does not follow NTP adjustments made later. Falls back to
+ * steady_clock on platforms without a TSC, and where the TSC is not
+ * invariant, so that its rate changes with frequency scaling and sleep states.
+ */
+class TscClock : public Clock
+{
+public:
+    TscClock()
+        : mInvariant(InvariantTsc())
+    {
+        auto startTicks = Ticks();
+        auto startTime = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto ticks = Ticks() - startTicks;
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - startTime).count();
+        mNanosecondsPerTick = ticks ? static_cast<double>(elapsed) / ticks : 1.0;
+
+        mBaseTicks = Ticks();
+        mBaseTime = std::chrono::system_clock::now();
+    }
+
+    std::chrono::system_clock::time_point Now() override
+    {
+        auto nanoseconds = static_cast<long long>((Ticks() - mBaseTicks) * mNanosecondsPerTick);
+        return mBaseTime + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(nanoseconds));
+    }
+
+private:
+    /**
+     * @brief CPUID 0x80000007 EDX bit 8, the TSC running at a constant rate in all states.
+     */
+    static bool InvariantTsc()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (edx & (1u << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    unsigned long long Ticks() const
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (mInvariant)
+            return __rdtsc();
+#endif
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool mInvariant;
+    double mNanosecondsPerTick;
+    unsigned long long mBaseTicks;
+    std::chrono::system_clock::time_point mBaseTime;
+};
+
+std::unique_ptr<Clock> CreateClock(const std::string& name)
+{
+    if (name == "system")
+        return std::make_unique<SystemClock>();
+    if (name == "coarse")
+        return std::make_unique<CoarseClock>();
+    if (name == "tsc")
+        return std::make_unique<TscClock>();
+    return nullptr;
+}
+
+} // namespace bulk
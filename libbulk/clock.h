@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace bulk
+{
+
+/**
+ * @brief Source of bulk timestamps.
+ */
+class Clock
+{
+public:
+    virtual ~Clock() = default;
+
+    virtual std::chrono::system_clock::time_point Now() = 0;
+};
+
+std::unique_ptr<Clock> CreateClock(const std::string& name);
+
+} // namespace bulk
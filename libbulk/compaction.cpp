@@ -0,0 +1,188 @@
+#include "compaction.h"
+#include "input.h"
+
+#include <dirent.h>
+
+#include <charconv>
+
+namespace bulk
+{
+
+/**
+ * @brief Parses the name of a file a writer or the compactor creates:
+ * bulk<time>[_<stream>_<n>] and segment<time>[_<stream>]_<n>, ending in .log
+ * or .bin and possibly .gz, .lz4 or .zst, and archive<time>_<n>.bar.
+ *
+ * @param kind Receives bulk, segment or archive.
+ * @return The seconds the file is named after, -1 for any other name.
+ */
+static int64_t ParseReportName(std::string_view name, std::string_view& kind)
+{
+    auto consume = [&name](std::string_view text)
+    {
+        if (name.substr(0, text.size()) != text)
+            return false;
+        name.remove_prefix(text.size());
+        return true;
+    };
+    auto number = [&name](auto& value)
+    {
+        if (name.empty() || name[0] < '0' || name[0] > '9')
+            return false;
+        auto result = std::from_chars(name.data(), name.data() + name.size(), value);
+        if (result.ec != std::errc())
+            return false;
+        name.remove_prefix(static_cast<size_t>(result.ptr - name.data()));
+        return true;
+    };
+
+    kind = std::string_view();
+    for (std::string_view prefix : {"bulk", "segment", "archive"})
+    {
+        if (consume(prefix))
+        {
+            kind = prefix;
+            break;
+        }
+    }
+    int64_t timestamp;
+    uint64_t sequence;
+    if (kind.empty() || !number(timestamp))
+        return -1;
+    if (kind == "archive")
+        return consume("_") && number(sequence) && name == ".bar" ? timestamp : -1;
+
+    size_t parts = 0;
+    while (parts < 2 && consume("_"))
+    {
+        if (!number(sequence))
+            return -1;
+        ++parts;
+    }
+    if ((kind == "bulk" && parts == 1) || (kind == "segment" && parts == 0))
+        return -1;
+    if (!consume(".log") && !consume(".bin"))
+        return -1;
+    return name.empty() || name == ".gz" || name == ".lz4" || name == ".zst" ? timestamp : -1;
+}
+
+int64_t ReportTimestamp(const std::string& name)
+{
+    std::string_view kind;
+    auto timestamp = ParseReportName(name, kind);
+    return kind == "bulk" ? timestamp : -1;
+}
+
+/**
+ * @brief Tells whether a directory is named like a shard: a UTC hour or
+ * minute such as 2018012911 or 201801291107, or a hash in hex.
+ */
+static bool IsShardName(std::string_view name)
+{
+    auto decimal = std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; });
+    auto hex = std::all_of(name.begin(), name.end(),
+        [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+    return !name.empty() && hex && (name.size() <= 2 * sizeof(uint32_t) ||
+        (decimal && (name.size() == 10 || name.size() == 12)));
+}
+
+void ListReportFiles(const std::string& root, std::vector<int>& directories, std::vector<ReportFile>& files)
+{
+    auto path = root.empty() ? std::string(".") : root;
+    int top = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (top == -1)
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    directories.push_back(top);
+
+    std::function<void(int, const std::string&)> list = [&](int directory, const std::string& path)
+    {
+        DIR* entries = fdopendir(dup(directory));
+        if (!entries)
+            return;
+
+        while (auto entry = readdir(entries))
+        {
+            const char* name = entry->d_name;
+            struct stat status;
+            if (name[0] == '.' || fstatat(directory, name, &status, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+            std::string_view kind;
+            if (S_ISREG(status.st_mode) && ParseReportName(name, kind) != -1)
+            {
+                files.push_back(ReportFile{directory, name, path + name, status.st_mtime,
+                    static_cast<uint64_t>(status.st_size)});
+            }
+            else if (directory == top && S_ISDIR(status.st_mode) && IsShardName(name))
+            {
+                int shard = openat(directory, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (shard == -1)
+                    continue;
+                directories.push_back(shard);
+                list(shard, path + name + '/');
+            }
+        }
+        closedir(entries);
+    };
+
+    list(top, root.empty() ? std::string() : root + '/');
+}
+
+/**
+ * @brief Prints the bulk files of the archive named after the timestamp.
+ *
+ * @return The number of files found.
+ */
+static size_t LookupArchive(std::string_view archive, int64_t timestamp, const std::string& dictionary,
+    std::ostream& output)
+{
+    ArchiveFooter footer;
+    if (archive.size() < sizeof(footer))
+        throw std::runtime_error("Truncated archive");
+    memcpy(&footer, archive.data() + archive.size() - sizeof(footer), sizeof(footer));
+    auto indexSize = footer.Count * sizeof(ArchiveEntry);
+    if (footer.Magic != ArchiveFooter::ArchiveMagic || footer.IndexOffset > archive.size() - sizeof(footer) ||
+        indexSize > archive.size() - sizeof(footer) - footer.IndexOffset)
+        throw std::runtime_error("Invalid archive");
+    auto index = archive.substr(footer.IndexOffset, archive.size() - sizeof(footer) - footer.IndexOffset);
+    if (Crc32(0, index.data(), index.size()) != footer.Checksum)
+        throw std::runtime_error("Archive index checksum mismatch");
+
+    std::vector<ArchiveEntry> entries(footer.Count);
+    memcpy(entries.data(), index.data(), indexSize);
+    auto names = index.substr(indexSize);
+    auto range = std::equal_range(entries.begin(), entries.end(), ArchiveEntry{timestamp, 0, 0, 0, 0},
+        [](const ArchiveEntry& a, const ArchiveEntry& b) { return a.Timestamp < b.Timestamp; });
+    for (auto entry = range.first; entry != range.second; ++entry)
+    {
+        if (entry->Offset > footer.IndexOffset || entry->Size > footer.IndexOffset - entry->Offset ||
+            entry->NameOffset > names.size() || entry->NameSize > names.size() - entry->NameOffset)
+            throw std::runtime_error("Invalid archive entry");
+        PrintReport(archive.substr(entry->Offset, entry->Size), dictionary, output);
+    }
+    return static_cast<size_t>(range.second - range.first);
+}
+
+size_t LookupBulks(const std::string& root, int64_t timestamp, const std::string& dictionary, std::ostream& output)
+{
+    std::vector<int> directories;
+    std::vector<ReportFile> files;
+    ListReportFiles(root, directories, files);
+    for (int directory : directories)
+        close(directory);
+    std::sort(files.begin(), files.end(), [](const ReportFile& a, const ReportFile& b) { return a.Name < b.Name; });
+
+    size_t found = 0;
+    for (const auto& file : files)
+    {
+        if (file.Name.compare(0, 7, "archive") == 0)
+            found += LookupArchive(MappedFile(file.Path).Data(), timestamp, dictionary, output);
+        else if (ReportTimestamp(file.Name) == timestamp)
+        {
+            PrintReport(MappedFile(file.Path).Data(), dictionary, output);
+            ++found;
+        }
+    }
+    return found;
+}
+
+} // namespace bulk
@@ -0,0 +1,442 @@
+#pragma once
+
+#include "writer.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace bulk
+{
+
+/**
+ * @brief Runs a task once per interval on a thread of idle CPU and I/O priority.
+ */
+class PeriodicTask
+{
+public:
+    PeriodicTask(std::chrono::milliseconds interval, std::function<void()> task)
+        : mInterval(interval)
+        , mTask(std::move(task))
+        , mStopped(false)
+        , mThread([this]() { Run(); })
+    {
+    }
+
+    ~PeriodicTask()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mCondition.notify_one();
+        mThread.join();
+    }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+    /**
+     * @brief Tells a long running task to return early.
+     */
+    bool Stopped()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mStopped;
+    }
+
+private:
+    void Run()
+    {
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+        // IOPRIO_CLASS_IDLE for this thread; there is no glibc wrapper.
+        syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mCondition.wait_for(lock, mInterval, [this]() { return mStopped; }))
+        {
+            lock.unlock();
+            try
+            {
+                mTask();
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+            lock.lock();
+        }
+    }
+
+    std::chrono::milliseconds mInterval;
+    std::function<void()> mTask;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStopped;
+    std::thread mThread;
+};
+
+/**
+ * @brief Returns the seconds a report file is named after, -1 if it is not a bulk file.
+ */
+int64_t ReportTimestamp(const std::string& name);
+
+/**
+ * @brief A file found under the report root.
+ */
+struct ReportFile
+{
+    int Directory;
+    std::string Name;
+    std::string Path;
+    time_t Modified;
+    uint64_t Size;
+};
+
+/**
+ * @brief Lists the report, segment and archive files of the root and its shards.
+ *
+ * Only names a writer or the compactor gives are listed, and only shard
+ * directories are descended into, as other files may share the root.
+ *
+ * @param directories Receives the open descriptors of the directories listed,
+ * which the files refer to; the caller closes them.
+ */
+void ListReportFiles(const std::string& root, std::vector<int>& directories, std::vector<ReportFile>& files);
+
+struct RetentionOptions
+{
+    // Limits of the report files kept, 0 for none.
+    uint64_t MaxBytes = 0;
+    size_t MaxFiles = 0;
+    std::chrono::seconds MaxAge = std::chrono::seconds(0);
+    std::chrono::milliseconds Interval = std::chrono::milliseconds(1000);
+};
+
+/**
+ * @brief Deletes the oldest report files once they exceed the retention limits.
+ *
+ * Once per interval a background task lists the report root and its shards,
+ * and unlinks the oldest files, by modification time, until the files left
+ * are within the size, count and age limits. Files are unlinked relative to
+ * their directory in batches, checking for shutdown in between. Files the
+ * writers of this process have open, such as the segments of parallel
+ * streams, count towards the limits but are kept, as is the newest file.
+ * Shard directories stay, as writers remember them.
+ */
+class RetentionManager
+{
+public:
+    RetentionManager(const RetentionOptions& options, const std::string& root, ReportDirectory& directory)
+        : mOptions(options)
+        , mRoot(root)
+        , mDirectory(directory)
+        , mScans(Metrics::Instance().Get("retention.scans"))
+        , mDeletedFiles(Metrics::Instance().Get("retention.deleted_files"))
+        , mDeletedBytes(Metrics::Instance().Get("retention.deleted_bytes"))
+        , mTask(options.Interval, [this]() { Collect(); })
+    {
+    }
+
+private:
+    void Collect()
+    {
+        ++mScans;
+        std::vector<int> directories;
+        std::vector<ReportFile> files;
+        ListReportFiles(mRoot, directories, files);
+        // Taken after the listing, so that a file opened since is not listed.
+        auto open = mDirectory.OpenFiles();
+
+        std::sort(files.begin(), files.end(),
+            [](const ReportFile& a, const ReportFile& b) { return a.Modified < b.Modified; });
+        uint64_t bytes = 0;
+        for (const auto& file : files)
+            bytes += file.Size;
+        auto oldest = time(nullptr) - mOptions.MaxAge.count();
+
+        std::vector<const ReportFile*> expired;
+        size_t left = files.size();
+        for (size_t i = 0; i + 1 < files.size() &&
+            ((mOptions.MaxFiles != 0 && left > mOptions.MaxFiles) ||
+            (mOptions.MaxBytes != 0 && bytes > mOptions.MaxBytes) ||
+            (mOptions.MaxAge.count() != 0 && files[i].Modified < oldest)); ++i)
+        {
+            if (open.count(files[i].Path) != 0)
+                continue;
+            expired.push_back(&files[i]);
+            bytes -= files[i].Size;
+            --left;
+        }
+
+        for (size_t i = 0; i < expired.size(); ++i)
+        {
+            if (unlinkat(expired[i]->Directory, expired[i]->Name.c_str(), 0) == 0)
+            {
+                ++mDeletedFiles;
+                mDeletedBytes += expired[i]->Size;
+            }
+            if ((i + 1) % BatchSize == 0 && mTask.Stopped())
+                break;
+        }
+
+        for (int directory : directories)
+            close(directory);
+    }
+
+    static constexpr size_t BatchSize = 64;
+
+    RetentionOptions mOptions;
+    std::string mRoot;
+    ReportDirectory& mDirectory;
+    std::atomic<uint64_t>& mScans;
+    std::atomic<uint64_t>& mDeletedFiles;
+    std::atomic<uint64_t>& mDeletedBytes;
+    PeriodicTask mTask;
+};
+
+/**
+ * @brief Index entry of a file stored in an archive.
+ */
+struct ArchiveEntry
+{
+    // Seconds from the file name, by which the entries are sorted.
+    int64_t Timestamp;
+    uint64_t Offset;
+    uint64_t Size;
+    uint32_t NameOffset;
+    uint32_t NameSize;
+};
+
+/**
+ * @brief End of an archive of compacted report files.
+ *
+ * An archive holds the files one after another, unchanged, then the
+ * entries, then their names, then this footer. The checksum is the CRC-32
+ * of the entries and the names.
+ */
+struct ArchiveFooter
+{
+    static constexpr uint32_t ArchiveMagic = 0x43524142; // "BARC"
+
+    uint32_t Magic;
+    uint32_t Checksum;
+    uint64_t Count;
+    uint64_t IndexOffset;
+};
+
+static_assert(sizeof(ArchiveEntry) == 32, "Archive entries must have a fixed layout");
+
+static_assert(sizeof(ArchiveFooter) == 24, "The archive footer must have a fixed layout");
+
+struct CompactionOptions
+{
+    // Age after which bulk files are compacted, 0 to not compact.
+    std::chrono::seconds MinAge = std::chrono::seconds(0);
+    uint64_t ArchiveSize = 64 * 1024 * 1024;
+    std::chrono::milliseconds Interval = std::chrono::milliseconds(10000);
+};
+
+/**
+ * @brief Merges old bulk files into indexed archives.
+ *
+ * Once per interval a background task collects the bulk files older than
+ * the minimum age in each directory and stores them, ordered by timestamp,
+ * in archives of about the archive size named archive<first time>_<n>.bar.
+ * An archive is written under a temporary name, synced and renamed into
+ * place before the files it holds are unlinked, so that a crash leaves at
+ * worst a bulk both archived and loose. Recent files stay as they are.
+ */
+class Compactor
+{
+public:
+    Compactor(const CompactionOptions& options, const std::string& root)
+        : mOptions(options)
+        , mRoot(root)
+        , mArchives(Metrics::Instance().Get("compaction.archives"))
+        , mFiles(Metrics::Instance().Get("compaction.files"))
+        , mBytes(Metrics::Instance().Get("compaction.bytes"))
+        , mTask(options.Interval, [this]() { Compact(); })
+    {
+    }
+
+private:
+    struct Candidate
+    {
+        int64_t Timestamp;
+        std::string Name;
+        uint64_t Size;
+    };
+
+    void Compact()
+    {
+        std::vector<int> directories;
+        std::vector<ReportFile> files;
+        ListReportFiles(mRoot, directories, files);
+
+        auto oldest = time(nullptr) - mOptions.MinAge.count();
+        std::map<int, std::vector<Candidate>> candidates;
+        for (const auto& file : files)
+        {
+            auto timestamp = ReportTimestamp(file.Name);
+            if (timestamp != -1 && file.Modified < oldest)
+                candidates[file.Directory].push_back(Candidate{timestamp, file.Name, file.Size});
+        }
+
+        try
+        {
+            for (auto& directory : candidates)
+            {
+                auto& group = directory.second;
+                std::sort(group.begin(), group.end(), [](const Candidate& a, const Candidate& b)
+                {
+                    return std::tie(a.Timestamp, a.Name) < std::tie(b.Timestamp, b.Name);
+                });
+
+                for (size_t begin = 0, end = 0; begin < group.size() && !mTask.Stopped(); begin = end)
+                {
+                    uint64_t size = 0;
+                    for (end = begin; end < group.size() && (end == begin || size < mOptions.ArchiveSize); ++end)
+                        size += group[end].Size;
+                    if (end - begin > 1)
+                        Archive(directory.first, group.data() + begin, group.data() + end);
+                }
+            }
+        }
+        catch (...)
+        {
+            for (int directory : directories)
+                close(directory);
+            throw;
+        }
+        for (int directory : directories)
+            close(directory);
+    }
+
+    void Archive(int directory, const Candidate* begin, const Candidate* end)
+    {
+        const char* temporary = ".archive.tmp";
+        int archive = openat(directory, temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (archive == -1)
+            throw std::runtime_error(std::string("Cannot create archive: ") + strerror(errno));
+
+        std::vector<ArchiveEntry> entries;
+        std::vector<const Candidate*> archived;
+        std::string names;
+        std::string data;
+        uint64_t offset = 0;
+        try
+        {
+            for (auto candidate = begin; candidate != end; ++candidate)
+            {
+                // Files may be gone, deleted by retention in the meantime.
+                if (!ReadFile(directory, candidate->Name, data))
+                    continue;
+                WriteAll(archive, data, candidate->Name);
+                entries.push_back(ArchiveEntry{candidate->Timestamp, offset, data.size(),
+                    static_cast<uint32_t>(names.size()), static_cast<uint32_t>(candidate->Name.size())});
+                names += candidate->Name;
+                offset += data.size();
+                archived.push_back(candidate);
+            }
+            if (archived.empty())
+                throw std::runtime_error("Nothing left to archive");
+
+            std::string_view index(reinterpret_cast<const char*>(entries.data()),
+                entries.size() * sizeof(ArchiveEntry));
+            ArchiveFooter footer{ArchiveFooter::ArchiveMagic, Crc32(Crc32(0, index.data(), index.size()),
+                names.data(), names.size()), entries.size(), offset};
+            WriteAll(archive, index, temporary);
+            WriteAll(archive, names, temporary);
+            WriteAll(archive, std::string_view(reinterpret_cast<const char*>(&footer), sizeof(footer)), temporary);
+            if (fdatasync(archive) == -1)
+                throw std::runtime_error(std::string("Cannot sync archive: ") + strerror(errno));
+        }
+        catch (...)
+        {
+            close(archive);
+            unlinkat(directory, temporary, 0);
+            throw;
+        }
+        close(archive);
+
+        std::string name;
+        for (unsigned sequence = 1; ; ++sequence)
+        {
+            name = "archive" + std::to_string(begin->Timestamp) + '_' + std::to_string(sequence) + ".bar";
+            if (faccessat(directory, name.c_str(), F_OK, 0) == -1)
+                break;
+        }
+        if (renameat(directory, temporary, directory, name.c_str()) == -1)
+            throw std::runtime_error("Cannot rename archive to " + name + ": " + strerror(errno));
+        fsync(directory);
+
+        for (auto candidate : archived)
+            unlinkat(directory, candidate->Name.c_str(), 0);
+        ++mArchives;
+        mFiles += archived.size();
+        mBytes += offset;
+    }
+
+    static bool ReadFile(int directory, const std::string& name, std::string& data)
+    {
+        int fd = openat(directory, name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        struct stat status;
+        bool complete = fstat(fd, &status) == 0;
+        if (complete)
+        {
+            data.resize(static_cast<size_t>(status.st_size));
+            size_t done = 0;
+            while (complete && done < data.size())
+            {
+                ssize_t count = read(fd, &data[done], data.size() - done);
+                complete = count > 0;
+                done += complete ? static_cast<size_t>(count) : 0;
+            }
+        }
+        close(fd);
+        return complete;
+    }
+
+    CompactionOptions mOptions;
+    std::string mRoot;
+    std::atomic<uint64_t>& mArchives;
+    std::atomic<uint64_t>& mFiles;
+    std::atomic<uint64_t>& mBytes;
+    PeriodicTask mTask;
+};
+
+/**
+ * @brief Prints every bulk named after the timestamp found under the report
+ * root, whether in an archive or still a file of its own.
+ *
+ * @return The number of files found.
+ */
+size_t LookupBulks(const std::string& root, int64_t timestamp, const std::string& dictionary, std::ostream& output);
+
+} // namespace bulk
@@ -0,0 +1,493 @@
+#include "compression.h"
+#include "input.h"
+#include "runtime.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#ifdef BULK_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef BULK_WITH_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef BULK_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+namespace bulk
+{
+
+#ifdef BULK_WITH_ZLIB
+class GzipCompressor : public Compressor
+{
+public:
+    explicit GzipCompressor(int level)
+    {
+        mStream = z_stream();
+        if (deflateInit2(&mStream, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Cannot initialize gzip compression");
+    }
+
+    ~GzipCompressor()
+    {
+        deflateEnd(&mStream);
+    }
+
+    void Compress(std::string_view data, std::string& output) override
+    {
+        Deflate(data, Z_NO_FLUSH, output);
+    }
+
+    void Finish(std::string& output) override
+    {
+        Deflate(std::string_view(), Z_FINISH, output);
+        deflateReset(&mStream);
+    }
+
+    const char* Extension() const override
+    {
+        return ".gz";
+    }
+
+private:
+    void Deflate(std::string_view data, int flush, std::string& output)
+    {
+        mStream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        mStream.avail_in = static_cast<uInt>(data.size());
+        int result;
+        do
+        {
+            size_t offset = output.size();
+            output.resize(offset + BufferSize);
+            mStream.next_out = reinterpret_cast<Bytef*>(&output[offset]);
+            mStream.avail_out = BufferSize;
+            result = deflate(&mStream, flush);
+            output.resize(offset + BufferSize - mStream.avail_out);
+        }
+        while (mStream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+    }
+
+    static constexpr uInt BufferSize = 64 * 1024;
+    z_stream mStream;
+};
+#endif
+
+#ifdef BULK_WITH_LZ4
+class Lz4Compressor : public Compressor
+{
+public:
+    explicit Lz4Compressor(int level)
+        : mStarted(false)
+    {
+        memset(&mPreferences, 0, sizeof(mPreferences));
+        mPreferences.compressionLevel = level;
+        if (LZ4F_isError(LZ4F_createCompressionContext(&mContext, LZ4F_VERSION)))
+            throw std::runtime_error("Cannot initialize lz4 compression");
+    }
+
+    ~Lz4Compressor()
+    {
+        LZ4F_freeCompressionContext(mContext);
+    }
+
+    void Compress(std::string_view data, std::string& output) override
+    {
+        Begin(output);
+        size_t offset = output.size();
+        output.resize(offset + LZ4F_compressBound(data.size(), &mPreferences));
+        Append(LZ4F_compressUpdate(mContext, &output[offset], output.size() - offset, data.data(), data.size(), nullptr),
+            offset, output);
+    }
+
+    void Finish(std::string& output) override
+    {
+        Begin(output);
+        size_t offset = output.size();
+        output.resize(offset + LZ4F_compressBound(0, &mPreferences));
+        Append(LZ4F_compressEnd(mContext, &output[offset], output.size() - offset, nullptr), offset, output);
+        mStarted = false;
+    }
+
+    const char* Extension() const override
+    {
+        return ".lz4";
+    }
+
+private:
+    void Begin(std::string& output)
+    {
+        if (mStarted)
+            return;
+        size_t offset = output.size();
+        output.resize(offset + LZ4F_HEADER_SIZE_MAX);
+        Append(LZ4F_compressBegin(mContext, &output[offset], LZ4F_HEADER_SIZE_MAX, &mPreferences), offset, output);
+        mStarted = true;
+    }
+
+    static void Append(size_t result, size_t offset, std::string& output)
+    {
+        if (LZ4F_isError(result))
+            throw std::runtime_error(std::string("lz4 compression failed: ") + LZ4F_getErrorName(result));
+        output.resize(offset + result);
+    }
+
+    LZ4F_cctx* mContext;
+    LZ4F_preferences_t mPreferences;
+    bool mStarted;
+};
+#endif
+
+#ifdef BULK_WITH_ZSTD
+class ZstdCompressor : public Compressor
+{
+public:
+    ZstdCompressor(int level, const std::string& dictionary)
+        : mContext(ZSTD_createCCtx())
+    {
+        if (!mContext)
+            throw std::runtime_error("Cannot initialize zstd compression");
+        if (level)
+            Check(ZSTD_CCtx_setParameter(mContext, ZSTD_c_compressionLevel, level));
+        if (!dictionary.empty())
+            Check(ZSTD_CCtx_loadDictionary(mContext, dictionary.data(), dictionary.size()));
+    }
+
+    ~ZstdCompressor()
+    {
+        ZSTD_freeCCtx(mContext);
+    }
+
+    void Compress(std::string_view data, std::string& output) override
+    {
+        Stream(data, ZSTD_e_continue, output);
+    }
+
+    void Finish(std::string& output) override
+    {
+        Stream(std::string_view(), ZSTD_e_end, output);
+    }
+
+    const char* Extension() const override
+    {
+        return ".zst";
+    }
+
+private:
+    void Stream(std::string_view data, ZSTD_EndDirective directive, std::string& output)
+    {
+        ZSTD_inBuffer input = {data.data(), data.size(), 0};
+        size_t remaining;
+        do
+        {
+            size_t offset = output.size();
+            output.resize(offset + ZSTD_CStreamOutSize());
+            ZSTD_outBuffer buffer = {&output[offset], output.size() - offset, 0};
+            remaining = Check(ZSTD_compressStream2(mContext, &buffer, &input, directive));
+            output.resize(offset + buffer.pos);
+        }
+        while (directive == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+    }
+
+    static size_t Check(size_t result)
+    {
+        if (ZSTD_isError(result))
+            throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(result));
+        return result;
+    }
+
+    ZSTD_CCtx* mContext;
+};
+#endif
+
+std::unique_ptr<Compressor> CreateCompressor(const CompressionOptions& options)
+{
+    switch (options.Codec)
+    {
+#ifdef BULK_WITH_ZLIB
+    case Compression::Gzip:
+        return std::make_unique<GzipCompressor>(options.Level);
+#endif
+#ifdef BULK_WITH_LZ4
+    case Compression::Lz4:
+        return std::make_unique<Lz4Compressor>(options.Level);
+#endif
+#ifdef BULK_WITH_ZSTD
+    case Compression::Zstd:
+        return std::make_unique<ZstdCompressor>(options.Level, options.Dictionary);
+#endif
+    case Compression::None:
+        return nullptr;
+    default:
+        throw std::runtime_error("Compression is not supported by this build");
+    }
+}
+
+/**
+ * @brief Passes a report file on, decompressed if it is a gzip, lz4 or zstd
+ * stream, a piece at a time as it is decompressed.
+ *
+ * Concatenated frames, as written per segment, are decoded one after another.
+ * A stream that ends within a frame is reported as truncated.
+ */
+static void CatReport(std::string_view data, const std::string& dictionary,
+    const std::function<void(std::string_view)>& write)
+{
+    static const unsigned char GzipMagic[] = {0x1f, 0x8b};
+    static const unsigned char Lz4Magic[] = {0x04, 0x22, 0x4d, 0x18};
+    static const unsigned char ZstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    auto hasMagic = [data](const unsigned char* magic, size_t size)
+    {
+        return data.size() >= size && memcmp(data.data(), magic, size) == 0;
+    };
+    std::vector<char> buffer(256 * 1024);
+    (void)dictionary;
+
+    if (hasMagic(GzipMagic, sizeof(GzipMagic)))
+    {
+#ifdef BULK_WITH_ZLIB
+        z_stream stream = z_stream();
+        if (inflateInit2(&stream, 15 + 16) != Z_OK)
+            throw std::runtime_error("Cannot initialize gzip decompression");
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = static_cast<uInt>(data.size());
+        bool ended = false;
+        for (;;)
+        {
+            stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+            stream.avail_out = static_cast<uInt>(buffer.size());
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error("Corrupted gzip stream");
+            }
+            try
+            {
+                write(std::string_view(buffer.data(), buffer.size() - stream.avail_out));
+            }
+            catch (...)
+            {
+                inflateEnd(&stream);
+                throw;
+            }
+            ended = result == Z_STREAM_END;
+            if (ended && stream.avail_in != 0)
+                inflateReset(&stream);
+            else if (stream.avail_out != 0)
+                break;
+        }
+        inflateEnd(&stream);
+        if (!ended)
+            throw std::runtime_error("Truncated gzip stream");
+        return;
+#endif
+    }
+    else if (hasMagic(Lz4Magic, sizeof(Lz4Magic)))
+    {
+#ifdef BULK_WITH_LZ4
+        LZ4F_dctx* context;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION)))
+            throw std::runtime_error("Cannot initialize lz4 decompression");
+        size_t result = 0;
+        for (size_t outputSize = buffer.size(); !data.empty() || outputSize == buffer.size(); )
+        {
+            outputSize = buffer.size();
+            size_t inputSize = data.size();
+            result = LZ4F_decompress(context, buffer.data(), &outputSize, data.data(), &inputSize, nullptr);
+            if (LZ4F_isError(result))
+            {
+                LZ4F_freeDecompressionContext(context);
+                throw std::runtime_error(std::string("lz4 decompression failed: ") + LZ4F_getErrorName(result));
+            }
+            try
+            {
+                write(std::string_view(buffer.data(), outputSize));
+            }
+            catch (...)
+            {
+                LZ4F_freeDecompressionContext(context);
+                throw;
+            }
+            data.remove_prefix(inputSize);
+        }
+        LZ4F_freeDecompressionContext(context);
+        if (result != 0)
+            throw std::runtime_error("Truncated lz4 stream");
+        return;
+#endif
+    }
+    else if (hasMagic(ZstdMagic, sizeof(ZstdMagic)))
+    {
+#ifdef BULK_WITH_ZSTD
+        ZSTD_DCtx* context = ZSTD_createDCtx();
+        if (!context)
+            throw std::runtime_error("Cannot initialize zstd decompression");
+        if (!dictionary.empty())
+        {
+            size_t loaded = ZSTD_DCtx_loadDictionary(context, dictionary.data(), dictionary.size());
+            if (ZSTD_isError(loaded))
+            {
+                ZSTD_freeDCtx(context);
+                throw std::runtime_error(std::string("Cannot load the zstd dictionary: ") +
+                    ZSTD_getErrorName(loaded));
+            }
+        }
+        ZSTD_inBuffer input = {data.data(), data.size(), 0};
+        size_t result = 0;
+        for (bool full = true; input.pos < input.size || full; )
+        {
+            ZSTD_outBuffer out = {buffer.data(), buffer.size(), 0};
+            result = ZSTD_decompressStream(context, &out, &input);
+            if (ZSTD_isError(result))
+            {
+                ZSTD_freeDCtx(context);
+                throw std::runtime_error(std::string("zstd decompression failed: ") + ZSTD_getErrorName(result));
+            }
+            try
+            {
+                write(std::string_view(buffer.data(), out.pos));
+            }
+            catch (...)
+            {
+                ZSTD_freeDCtx(context);
+                throw;
+            }
+            full = out.pos == out.size;
+        }
+        ZSTD_freeDCtx(context);
+        if (result != 0)
+            throw std::runtime_error("Truncated zstd stream");
+        return;
+#endif
+    }
+    else
+    {
+        write(data);
+        return;
+    }
+
+    throw std::runtime_error("Compression is not supported by this build");
+}
+
+/**
+ * @brief Prints a report as it is decompressed: text as it is, binary
+ * records decoded, each as soon as it is complete.
+ */
+class ReportPrinter
+{
+public:
+    explicit ReportPrinter(std::ostream& output)
+        : mOutput(output)
+        , mFormat(ReportFormat::Text)
+        , mKnown(false)
+        , mLast('\n')
+    {
+    }
+
+    void Write(std::string_view piece)
+    {
+        if (!mKnown)
+        {
+            mPending.append(piece);
+            if (mPending.size() < sizeof(uint32_t))
+                return;
+            uint32_t magic;
+            memcpy(&magic, mPending.data(), sizeof(magic));
+            mFormat = magic == BulkRecordHeader::BulkMagic ? ReportFormat::Binary : ReportFormat::Text;
+            mKnown = true;
+            std::string pending;
+            pending.swap(mPending);
+            Write(pending);
+            return;
+        }
+
+        if (mFormat == ReportFormat::Text)
+        {
+            if (!piece.empty())
+            {
+                mOutput.write(piece.data(), piece.size());
+                mLast = piece.back();
+            }
+            return;
+        }
+
+        mPending.append(piece);
+        size_t complete = 0;
+        while (mPending.size() - complete >= sizeof(BulkRecordHeader))
+        {
+            BulkRecordHeader header;
+            memcpy(&header, mPending.data() + complete, sizeof(header));
+            if (header.Size < sizeof(header))
+                throw std::runtime_error("Invalid bulk record");
+            if (header.Size > mPending.size() - complete)
+                break;
+            complete += header.Size;
+        }
+        DecodeBulkRecords(std::string_view(mPending.data(), complete), [this](const Bulk& bulk)
+        {
+            mOutput << FormatBulk(bulk) << '\n';
+        });
+        mPending.erase(0, complete);
+    }
+
+    void Finish()
+    {
+        if (!mKnown)
+        {
+            mKnown = true;
+            std::string pending;
+            pending.swap(mPending);
+            Write(pending);
+        }
+        if (mFormat == ReportFormat::Binary)
+            DecodeBulkRecords(mPending, [](const Bulk&) {});
+        else if (mLast != '\n')
+            mOutput << '\n';
+        mOutput.flush();
+    }
+
+private:
+    std::ostream& mOutput;
+    ReportFormat mFormat;
+    bool mKnown;
+    char mLast;
+    // Binary data short of a complete record, or the start of the report until its format is known.
+    std::string mPending;
+};
+
+void PrintReport(std::string_view data, const std::string& dictionary, std::ostream& output)
+{
+    ReportPrinter printer(output);
+    CatReport(data, dictionary, [&printer](std::string_view piece) { printer.Write(piece); });
+    printer.Finish();
+}
+
+#ifdef BULK_WITH_ZSTD
+std::string TrainDictionary(const std::vector<std::string>& sampleFiles, size_t capacity)
+{
+    std::string samples;
+    std::vector<size_t> sampleSizes;
+    for (const auto& sampleFile : sampleFiles)
+    {
+        MappedFile file(sampleFile);
+        samples.append(file.Data());
+        sampleSizes.push_back(file.Data().size());
+    }
+
+    std::string dictionary(capacity, '\0');
+    size_t size = ZDICT_trainFromBuffer(&dictionary[0], capacity, samples.data(), sampleSizes.data(),
+        static_cast<unsigned>(sampleSizes.size()));
+    if (ZDICT_isError(size))
+        throw std::runtime_error(std::string("Cannot train dictionary: ") + ZDICT_getErrorName(size));
+    dictionary.resize(size);
+    return dictionary;
+}
+#endif
+
+} // namespace bulk
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bulk
+{
+
+enum class Compression
+{
+    None,
+    Gzip,
+    Lz4,
+    Zstd
+};
+
+/**
+ * @brief How ReportWriter compresses its files.
+ *
+ * Per file, every bulk is a separate compressed file. Per segment, bulks are
+ * appended one per line to a compressed stream that is rotated once
+ * SegmentSize uncompressed bytes were written.
+ */
+struct CompressionOptions
+{
+    Compression Codec = Compression::None;
+    int Level = 0;
+    bool Segment = false;
+    size_t SegmentSize = 64 * 1024 * 1024;
+    std::string Dictionary;
+    std::string DictionaryPath;
+};
+
+/**
+ * @brief Streaming compressor; Finish ends the current frame and starts the next one.
+ */
+class Compressor
+{
+public:
+    virtual ~Compressor() = default;
+
+    virtual void Compress(std::string_view data, std::string& output) = 0;
+    virtual void Finish(std::string& output) = 0;
+    virtual const char* Extension() const = 0;
+};
+
+std::unique_ptr<Compressor> CreateCompressor(const CompressionOptions& options);
+
+/**
+ * @brief Prints a report file as --cat does: decompressed, with binary records decoded.
+ */
+void PrintReport(std::string_view data, const std::string& dictionary, std::ostream& output);
+
+#ifdef BULK_WITH_ZSTD
+/**
+ * @brief Trains a zstd dictionary on sample report files.
+ */
+std::string TrainDictionary(const std::vector<std::string>& sampleFiles, size_t capacity);
+#endif
+
+} // namespace bulk
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "async.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bulk
+{
+
+/**
+ * @brief Prints the bulks; with a degraded load given it skips them while
+ * that sink is overloaded, so that the console gives way to the files.
+ *
+ * The console comes first in the pipeline, so the load it reads is the one
+ * the previous bulk left behind: a bulk is skipped because the bulk before
+ * it found the queue full.
+ *
+ * A streamed bulk is collected in a temporary file and printed once it is
+ * finished, so that a discarded one leaves no partial line behind.
+ */
+class ConsoleOutput : public CommandProcessor
+{
+public:
+    ConsoleOutput(CommandProcessor* nextCommandProcessor = nullptr, const SinkLoad* degrade = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mDegrade(degrade)
+        , mSkipped(Metrics::Instance().Get("console.skipped"))
+        , mStream(-1)
+        , mStreamEmpty(true)
+    {
+    }
+
+    ~ConsoleOutput()
+    {
+        if (mStream != -1)
+            close(mStream);
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        if (mDegrade && mDegrade->Overloaded())
+            ++mSkipped;
+        else
+            std::cout << bulk.Text << std::endl;
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+    /**
+     * @brief Writes the lines of all bulks with one writev.
+     */
+    void ProcessBulks(const Bulk* bulks, size_t count) override
+    {
+        if (mDegrade && mDegrade->Overloaded())
+        {
+            mSkipped += count;
+            if (mNextCommandProcessor)
+                mNextCommandProcessor->ProcessBulks(bulks, count);
+            return;
+        }
+
+        static char newline = '\n';
+        mBuffers.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            mBuffers.push_back(iovec{const_cast<char*>(bulks[i].Text.data()), bulks[i].Text.size()});
+            mBuffers.push_back(iovec{&newline, 1});
+        }
+        std::cout.flush();
+        WriteVector(STDOUT_FILENO, mBuffers, "stdout");
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulks(bulks, count);
+    }
+
+    void StartStream(std::chrono::system_clock::time_point timestamp) override
+    {
+        if (mDegrade && mDegrade->Overloaded())
+            ++mSkipped;
+        else
+        {
+            mStream = CreateTemporaryFile(TemporaryDirectory(), "console");
+            mStreamEmpty = true;
+            WriteAll(mStream, "bulk: ", "a temporary file");
+        }
+
+        CommandProcessor::StartStream(timestamp);
+    }
+
+    void StreamCommands(const CommandList& commands) override
+    {
+        if (mStream != -1 && !commands.empty())
+        {
+            mBuffer.clear();
+            for (const auto& command : commands)
+            {
+                if (!mStreamEmpty)
+                    mBuffer.append(", ");
+                mBuffer.append(command);
+                mStreamEmpty = false;
+            }
+            WriteAll(mStream, mBuffer, "a temporary file");
+        }
+
+        CommandProcessor::StreamCommands(commands);
+    }
+
+    void FinishStream(bool publish) override
+    {
+        if (mStream != -1)
+        {
+            int stream = mStream;
+            mStream = -1;
+            try
+            {
+                if (publish)
+                {
+                    WriteAll(stream, "\n", "a temporary file");
+                    std::cout.flush();
+                    CopyFile(stream, STDOUT_FILENO, "stdout");
+                }
+            }
+            catch (...)
+            {
+                close(stream);
+                throw;
+            }
+            close(stream);
+        }
+
+        CommandProcessor::FinishStream(publish);
+    }
+
+private:
+    const SinkLoad* mDegrade;
+    std::atomic<uint64_t>& mSkipped;
+    std::vector<iovec> mBuffers;
+    // Temporary file of the bulk being streamed, -1 if none.
+    int mStream;
+    bool mStreamEmpty;
+    std::string mBuffer;
+};
+
+/**
+ * @brief Serializes console output of streams processed in parallel.
+ *
+ * In file order the output of each stream appears contiguously, streams in
+ * index order; later streams are buffered until earlier ones finish. In bulk
+ * order lines are written as they come, each stream keeping its own order.
+ * Streamed bulks come as temporary files, which are buffered as they are.
+ */
+class OrderedConsole
+{
+public:
+    enum class Interleave
+    {
+        File,
+        Bulk
+    };
+
+    OrderedConsole(size_t streamCount, Interleave interleave)
+        : mInterleave(interleave)
+        , mCurrentStream(0)
+        , mBuffers(streamCount)
+        , mFinished(streamCount, false)
+    {
+    }
+
+    ~OrderedConsole()
+    {
+        for (const auto& buffer : mBuffers)
+        {
+            for (const auto& part : buffer)
+            {
+                if (part.File != -1)
+                    close(part.File);
+            }
+        }
+    }
+
+    OrderedConsole(const OrderedConsole&) = delete;
+    OrderedConsole& operator=(const OrderedConsole&) = delete;
+
+    void Write(size_t stream, std::string_view text)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mInterleave == Interleave::Bulk || stream == mCurrentStream)
+            std::cout << text << std::endl;
+        else
+        {
+            auto& buffer = mBuffers[stream];
+            if (buffer.empty() || buffer.back().File != -1)
+                buffer.emplace_back();
+            buffer.back().Text.append(text).append(1, '\n');
+        }
+    }
+
+    /**
+     * @brief Takes over the descriptor of a temporary file holding complete lines.
+     */
+    void WriteFile(size_t stream, int fd)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mInterleave == Interleave::Bulk || stream == mCurrentStream)
+        {
+            Part part;
+            part.File = fd;
+            Flush(part);
+        }
+        else
+        {
+            mBuffers[stream].emplace_back();
+            mBuffers[stream].back().File = fd;
+        }
+    }
+
+    void Finish(size_t stream)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFinished[stream] = true;
+        while (mCurrentStream < mFinished.size() && mFinished[mCurrentStream])
+        {
+            if (++mCurrentStream < mBuffers.size())
+            {
+                std::vector<Part> buffer;
+                buffer.swap(mBuffers[mCurrentStream]);
+                for (auto& part : buffer)
+                    Flush(part);
+                std::cout.flush();
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Buffered text, or a temporary file if File is not -1.
+     */
+    struct Part
+    {
+        std::string Text;
+        int File = -1;
+    };
+
+    void Flush(Part& part)
+    {
+        if (part.File == -1)
+        {
+            std::cout << part.Text;
+            return;
+        }
+
+        int fd = part.File;
+        part.File = -1;
+        try
+        {
+            std::cout.flush();
+            CopyFile(fd, STDOUT_FILENO, "stdout");
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    Interleave mInterleave;
+    std::mutex mMutex;
+    size_t mCurrentStream;
+    std::vector<std::vector<Part>> mBuffers;
+    std::vector<bool> mFinished;
+};
+
+class OrderedConsoleOutput : public CommandProcessor
+{
+public:
+    /**
+     * @param degrade As for ConsoleOutput.
+     */
+    OrderedConsoleOutput(OrderedConsole& console, size_t stream, CommandProcessor* nextCommandProcessor = nullptr,
+        const SinkLoad* degrade = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mConsole(console)
+        , mStream(stream)
+        , mDegrade(degrade)
+        , mSkipped(Metrics::Instance().Get("console.skipped"))
+        , mStreamFile(-1)
+        , mStreamEmpty(true)
+    {
+    }
+
+    ~OrderedConsoleOutput()
+    {
+        if (mStreamFile != -1)
+            close(mStreamFile);
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        if (mDegrade && mDegrade->Overloaded())
+            ++mSkipped;
+        else
+            mConsole.Write(mStream, bulk.Text);
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+    /**
+     * @brief Collects a streamed bulk in a temporary file, handed to the console once finished.
+     */
+    void StartStream(std::chrono::system_clock::time_point timestamp) override
+    {
+        if (mDegrade && mDegrade->Overloaded())
+            ++mSkipped;
+        else
+        {
+            mStreamFile = CreateTemporaryFile(TemporaryDirectory(), "console");
+            mStreamEmpty = true;
+            WriteAll(mStreamFile, "bulk: ", "a temporary file");
+        }
+
+        CommandProcessor::StartStream(timestamp);
+    }
+
+    void StreamCommands(const CommandList& commands) override
+    {
+        if (mStreamFile != -1 && !commands.empty())
+        {
+            mBuffer.assign(mStreamEmpty ? "" : ", ").append(Join(commands));
+            WriteAll(mStreamFile, mBuffer, "a temporary file");
+            mStreamEmpty = false;
+        }
+
+        CommandProcessor::StreamCommands(commands);
+    }
+
+    void FinishStream(bool publish) override
+    {
+        if (mStreamFile != -1)
+        {
+            int stream = mStreamFile;
+            mStreamFile = -1;
+            if (publish)
+            {
+                try
+                {
+                    WriteAll(stream, "\n", "a temporary file");
+                }
+                catch (...)
+                {
+                    close(stream);
+                    throw;
+                }
+                mConsole.WriteFile(mStream, stream);
+            }
+            else
+                close(stream);
+        }
+
+        CommandProcessor::FinishStream(publish);
+    }
+
+private:
+    OrderedConsole& mConsole;
+    size_t mStream;
+    const SinkLoad* mDegrade;
+    std::atomic<uint64_t>& mSkipped;
+    // Temporary file of the bulk being streamed, -1 if none.
+    int mStreamFile;
+    bool mStreamEmpty;
+    std::string mBuffer;
+};
+
+} // namespace bulk
@@ -0,0 +1,133 @@
+#include "core.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+namespace bulk
+{
+
+std::string Join(const CommandList& v)
+{
+    std::string result;
+    result.reserve(v.Bytes().size() + (v.empty() ? 0 : 2 * (v.size() - 1)));
+    for(size_t i = 0; i < v.size(); ++i)
+    {
+        if(i != 0)
+            result.append(", ");
+        result.append(v[i]);
+    }
+    return result;
+}
+
+size_t MemoryUsage(const Bulk& bulk)
+{
+    return sizeof(Bulk) + bulk.Text.size() + bulk.Commands.Bytes().size() +
+        bulk.Commands.size() * sizeof(uint64_t);
+}
+
+std::string FormatBulk(const Bulk& bulk)
+{
+    return "bulk: " + Join(bulk.Commands) + (bulk.Continued ? ", ..." : "");
+}
+
+int CreateTemporaryFile(const std::string& directory, const char* purpose)
+{
+    std::string path = directory + "/bulk-XXXXXX";
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1)
+        throw std::runtime_error(std::string("Cannot create a ") + purpose + " file in " + directory + ": " +
+            strerror(errno));
+    unlink(path.c_str());
+    return fd;
+}
+
+void WriteAll(int fd, std::string_view data, const std::string& path)
+{
+    while (!data.empty())
+    {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Cannot write " + path + ": " + strerror(errno));
+        }
+        data.remove_prefix(written);
+    }
+}
+
+void CopyFile(int from, int to, const std::string& path)
+{
+    char buffer[64 * 1024];
+    for (off_t offset = 0; ; )
+    {
+        ssize_t result = pread(from, buffer, sizeof(buffer), offset);
+        if (result == -1 && errno == EINTR)
+            continue;
+        if (result == -1)
+            throw std::runtime_error(std::string("Cannot read a temporary file: ") + strerror(errno));
+        if (result == 0)
+            return;
+        WriteAll(to, std::string_view(buffer, result), path);
+        offset += result;
+    }
+}
+
+std::string TemporaryDirectory()
+{
+    const char* directory = getenv("TMPDIR");
+    return directory && *directory ? directory : "/tmp";
+}
+
+void WriteVector(int fd, std::vector<iovec>& buffers, const char* path)
+{
+    size_t first = 0;
+    while (first < buffers.size())
+    {
+        int count = static_cast<int>(std::min<size_t>(buffers.size() - first, IOV_MAX));
+        ssize_t written = writev(fd, &buffers[first], count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("Cannot write ") + path + ": " + strerror(errno));
+        }
+        for (auto left = static_cast<size_t>(written); left != 0; )
+        {
+            auto& buffer = buffers[first];
+            size_t step = std::min(left, buffer.iov_len);
+            buffer.iov_base = static_cast<char*>(buffer.iov_base) + step;
+            buffer.iov_len -= step;
+            left -= step;
+            if (buffer.iov_len == 0)
+                ++first;
+        }
+        while (first < buffers.size() && buffers[first].iov_len == 0)
+            ++first;
+    }
+}
+
+int WriteFile(const std::string& path, std::string_view data, bool append)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+    if (fd == -1)
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    try
+    {
+        WriteAll(fd, data, path);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    return fd;
+}
+
+} // namespace bulk
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "bulk.h"
+
+#include <sys/uio.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Batch command processor.
+ *
+ * Everything but the interface declared in bulk.h is internal to the library,
+ * which is built with hidden visibility.
+ */
+namespace bulk
+{
+
+/**
+ * @brief Input line.
+ *
+ * Input commands are not timestamped; BatchCommandProcessor stamps a bulk
+ * when its first command arrives, since that is the only time reported.
+ */
+struct Command
+{
+    std::string_view Text;
+    std::chrono::system_clock::time_point Timestamp;
+};
+
+/**
+ * @brief Process-wide named counters and gauges, printed on exit with --metrics.
+ */
+class Metrics
+{
+public:
+    static Metrics& Instance()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    /**
+     * @brief Returns the value registered under the name; references stay valid.
+     */
+    std::atomic<uint64_t>& Get(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mValues.try_emplace(name, 0).first->second;
+    }
+
+    static void Max(std::atomic<uint64_t>& value, uint64_t sample)
+    {
+        auto current = value.load(std::memory_order_relaxed);
+        while (current < sample && !value.compare_exchange_weak(current, sample, std::memory_order_relaxed))
+            ;
+    }
+
+    void Print(std::ostream& output)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto& value : mValues)
+            output << value.first << ' ' << value.second.load() << std::endl;
+    }
+
+private:
+    std::mutex mMutex;
+    std::map<std::string, std::atomic<uint64_t>> mValues;
+};
+
+std::string Join(const CommandList& v);
+
+/**
+ * @brief Bytes held by the pipeline, by where they are held: input buffers,
+ * bulks being formed and queues in front of the sinks.
+ *
+ * Keeps memory.<pool>.bytes and memory.<pool>.peak in the metrics, and
+ * memory.total.peak. With a limit set, queues count as full and dynamic
+ * blocks as oversized while the total exceeds it. The accounting is process
+ * wide, so only the bulk executable sets a limit; BulkEngine rejects one.
+ */
+class MemoryAccountant
+{
+public:
+    enum class Pool
+    {
+        Input,
+        Batch,
+        Queue
+    };
+
+    static MemoryAccountant& Instance()
+    {
+        static MemoryAccountant accountant;
+        return accountant;
+    }
+
+    /**
+     * @param limit Bytes, 0 for no limit.
+     */
+    void SetLimit(size_t limit)
+    {
+        mLimit.store(limit, std::memory_order_relaxed);
+    }
+
+    void Add(Pool pool, size_t bytes)
+    {
+        auto& bytesHeld = mPools[static_cast<int>(pool)];
+        Metrics::Max(*bytesHeld.Peak, bytesHeld.Bytes->fetch_add(bytes, std::memory_order_relaxed) + bytes);
+        Metrics::Max(mTotalPeak, mTotal.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    }
+
+    void Release(Pool pool, size_t bytes)
+    {
+        mPools[static_cast<int>(pool)].Bytes->fetch_sub(bytes, std::memory_order_relaxed);
+        mTotal.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    bool OverLimit() const
+    {
+        auto limit = mLimit.load(std::memory_order_relaxed);
+        return limit != 0 && mTotal.load(std::memory_order_relaxed) > limit;
+    }
+
+private:
+    struct PoolMetrics
+    {
+        std::atomic<uint64_t>* Bytes;
+        std::atomic<uint64_t>* Peak;
+    };
+
+    MemoryAccountant()
+        : mTotalPeak(Metrics::Instance().Get("memory.total.peak"))
+    {
+        const char* names[] = {"input", "batch", "queue"};
+        for (size_t i = 0; i < mPools.size(); ++i)
+        {
+            mPools[i].Bytes = &Metrics::Instance().Get(std::string("memory.") + names[i] + ".bytes");
+            mPools[i].Peak = &Metrics::Instance().Get(std::string("memory.") + names[i] + ".peak");
+        }
+    }
+
+    std::array<PoolMetrics, 3> mPools;
+    std::atomic<uint64_t> mTotal{0};
+    std::atomic<uint64_t>& mTotalPeak;
+    std::atomic<size_t> mLimit{0};
+};
+
+/**
+ * @brief Bytes a bulk holds, as counted by MemoryAccountant.
+ */
+size_t MemoryUsage(const Bulk& bulk);
+
+/**
+ * @brief The text line of a bulk; a bulk continued by the next one ends with "...".
+ */
+std::string FormatBulk(const Bulk& bulk);
+
+class CommandProcessor
+{
+public:
+    CommandProcessor(CommandProcessor* nextCommandProcessor = nullptr)
+        : mNextCommandProcessor(nextCommandProcessor)
+    {
+    }
+
+    virtual ~CommandProcessor() = default;
+
+    virtual void StartBlock() {}
+    virtual void FinishBlock() {}
+
+    virtual void ProcessCommand(const Command& command)
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessCommand(command);
+    }
+
+    virtual void ProcessBulk(const Bulk& bulk)
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+    /**
+     * @brief Passes bulks formed together, such as those queued since a worker
+     * last woke up; by default they go to ProcessBulk one by one.
+     */
+    virtual void ProcessBulks(const Bulk* bulks, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            ProcessBulk(bulks[i]);
+    }
+
+    /**
+     * @brief Called periodically while input is idle.
+     */
+    virtual void Tick()
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->Tick();
+    }
+
+    /**
+     * @brief Starts a bulk that is passed on in slices of commands rather than
+     * as a whole, for a dynamic block too large to hold in memory.
+     *
+     * No other bulk comes between StartStream() and FinishStream(). Sinks that
+     * keep bulks whole, such as plugins, pass the stream on without seeing it.
+     */
+    virtual void StartStream(std::chrono::system_clock::time_point timestamp)
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->StartStream(timestamp);
+    }
+
+    virtual void StreamCommands(const CommandList& commands)
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->StreamCommands(commands);
+    }
+
+    /**
+     * @param publish False if input ended inside the block, which is then discarded.
+     */
+    virtual void FinishStream(bool publish)
+    {
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->FinishStream(publish);
+    }
+
+protected:
+    CommandProcessor* mNextCommandProcessor;
+};
+
+/**
+ * @brief Creates a file in the directory and unlinks it right away, so that
+ * it goes away with its descriptor whatever happens.
+ */
+int CreateTemporaryFile(const std::string& directory, const char* purpose);
+
+/**
+ * @brief Writes all data, retrying short writes.
+ */
+void WriteAll(int fd, std::string_view data, const std::string& path);
+
+/**
+ * @brief Copies a file from its start to another descriptor.
+ */
+void CopyFile(int from, int to, const std::string& path);
+
+/**
+ * @brief Directory for temporary files, TMPDIR or /tmp.
+ */
+std::string TemporaryDirectory();
+
+/**
+ * @brief Writes all buffers with as few writev calls as IOV_MAX allows, retrying short writes.
+ */
+void WriteVector(int fd, std::vector<iovec>& buffers, const char* path);
+
+/**
+ * @brief Writes the data to a file with a single write, truncating or appending.
+ *
+ * @return The open descriptor, so that the caller may sync it before closing.
+ */
+int WriteFile(const std::string& path, std::string_view data, bool append);
+
+} // namespace bulk
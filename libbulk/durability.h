@@ -0,0 +1,346 @@
+#pragma once
+
+#include "core.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bulk
+{
+
+enum class Durability
+{
+    None,
+    Group,
+    Bulk
+};
+
+struct DurabilityOptions
+{
+    Durability Mode = Durability::None;
+    std::chrono::milliseconds Interval = std::chrono::milliseconds(100);
+    bool SyncFs = false;
+};
+
+/**
+ * @brief Makes report files durable.
+ *
+ * Per bulk, every write is synced before ReportWriter moves on. With group
+ * commit, finished files are handed over and files still being appended to
+ * are registered; once per interval a background thread syncs all of them
+ * (or the whole file system with a single syncfs) and the report directories.
+ * A failed sync is not retried, as the kernel may have dropped the data it
+ * could not write: it is counted, and the writer gets the error thrown from
+ * the call that failed or, with group commit, from every call that follows.
+ */
+class DurabilityManager
+{
+public:
+    /**
+     * @param root Report directory, synced for files created in it and used by syncfs.
+     */
+    DurabilityManager(const DurabilityOptions& options, const std::string& root = ".")
+        : mOptions(options)
+        , mDirectory(-1)
+        , mWritten(0)
+        , mDurable(0)
+        , mStopped(false)
+        , mSyncs(Metrics::Instance().Get("durability.syncs"))
+        , mSyncFailures(Metrics::Instance().Get("durability.sync_failures"))
+        , mSyncedFiles(Metrics::Instance().Get("durability.synced_files"))
+        , mLatencyTotal(Metrics::Instance().Get("durability.sync_latency_us.total"))
+        , mLatencyMax(Metrics::Instance().Get("durability.sync_latency_us.max"))
+    {
+        if (mOptions.Mode != Durability::None)
+        {
+            mDirectory = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (mDirectory == -1)
+                throw std::runtime_error(std::string("Cannot open report directory: ") + strerror(errno));
+        }
+        if (mOptions.Mode == Durability::Group)
+            mThread = std::thread([this]() { Run(); });
+    }
+
+    ~DurabilityManager()
+    {
+        if (mThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mStopped = true;
+            }
+            mCondition.notify_all();
+            mThread.join();
+        }
+        if (mDirectory != -1)
+            close(mDirectory);
+    }
+
+    DurabilityManager(const DurabilityManager&) = delete;
+    DurabilityManager& operator=(const DurabilityManager&) = delete;
+
+    /**
+     * @brief Takes over the descriptor of a completely written file.
+     *
+     * @param directory Where the file was created, if not in the root.
+     * @throw std::runtime_error if the file, or with group commit an earlier one, could not be synced.
+     */
+    void Commit(int fd, const std::string& directory = std::string())
+    {
+        switch (mOptions.Mode)
+        {
+        case Durability::None:
+            close(fd);
+            return;
+        case Durability::Bulk:
+            {
+                auto start = std::chrono::steady_clock::now();
+                int result = fdatasync(fd);
+                int error = errno;
+                close(fd);
+                if (result == -1)
+                    Fail("Cannot sync a report file", error);
+                if (!SyncDirectory(directory))
+                    Fail("Cannot sync a report directory", errno);
+                Measure(start, 1);
+                return;
+            }
+        case Durability::Group:
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mError.empty())
+        {
+            close(fd);
+            throw std::runtime_error(mError);
+        }
+        mPending.push_back(fd);
+        if (!directory.empty())
+            mDirectories.insert(directory);
+        if (mPending.size() == MaxPendingFiles)
+            mCondition.notify_all();
+        ++mWritten;
+    }
+
+    /**
+     * @brief Registers the descriptor of a file that is going to be appended to.
+     *
+     * @throw std::runtime_error As Commit; the descriptor stays with the caller then.
+     */
+    void Open(int fd, const std::string& directory = std::string())
+    {
+        if (mOptions.Mode == Durability::Bulk)
+        {
+            if (!SyncDirectory(directory))
+                Fail("Cannot sync a report directory", errno);
+        }
+        else if (mOptions.Mode == Durability::Group)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mError.empty())
+                throw std::runtime_error(mError);
+            mRegistered.push_back(fd);
+            if (!directory.empty())
+                mDirectories.insert(directory);
+        }
+    }
+
+    /**
+     * @brief Notes that data was appended to a registered file.
+     *
+     * @throw std::runtime_error As Commit.
+     */
+    void Written(int fd)
+    {
+        if (mOptions.Mode == Durability::Bulk)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (fdatasync(fd) == -1)
+                Fail("Cannot sync a report file", errno);
+            Measure(start, 1);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mError.empty())
+            throw std::runtime_error(mError);
+        ++mWritten;
+    }
+
+    /**
+     * @brief Takes over the descriptor of a registered file that is complete.
+     */
+    void Close(int fd)
+    {
+        if (mOptions.Mode != Durability::Group)
+        {
+            close(fd);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRegistered.erase(std::find(mRegistered.begin(), mRegistered.end(), fd));
+        mPending.push_back(fd);
+    }
+
+    /**
+     * @brief Waits for a group commit to cover everything handed over so far;
+     * without group commit that is the case already.
+     *
+     * @throw std::runtime_error if any sync failed so far.
+     */
+    void WaitDurable()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        uint64_t target = mWritten;
+        if (mOptions.Mode == Durability::Group)
+            mCondition.wait(lock, [this, target]() { return mDurable >= target || !mError.empty() || mStopped; });
+        if (!mError.empty())
+            throw std::runtime_error(mError);
+    }
+
+private:
+    void Run()
+    {
+        std::vector<int> pending;
+        std::vector<int> registered;
+        std::set<std::string> directories;
+        bool stopped = false;
+        while (!stopped)
+        {
+            uint64_t target;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait_for(lock, mOptions.Interval,
+                    [this]() { return mStopped || mPending.size() >= MaxPendingFiles; });
+                stopped = mStopped;
+                if (mPending.empty() && mRegistered.empty() && mDurable == mWritten)
+                    continue;
+                target = mWritten;
+                pending.swap(mPending);
+                registered = mRegistered;
+                directories.swap(mDirectories);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            std::string error;
+            auto check = [&error](bool synced, const char* what)
+            {
+                if (!synced && error.empty())
+                    error = std::string(what) + ": " + strerror(errno);
+            };
+            if (mOptions.SyncFs)
+                check(syncfs(mDirectory) == 0, "Cannot sync the report file system");
+            else
+            {
+                for (int fd : pending)
+                    check(fdatasync(fd) == 0, "Cannot sync a report file");
+                for (int fd : registered)
+                    check(fdatasync(fd) == 0, "Cannot sync a report file");
+                for (const auto& directory : directories)
+                    check(SyncDirectory(directory), "Cannot sync a report directory");
+                check(fsync(mDirectory) == 0, "Cannot sync a report directory");
+            }
+            for (int fd : pending)
+                close(fd);
+            Measure(start, pending.size() + registered.size());
+            pending.clear();
+            directories.clear();
+
+            if (!error.empty())
+            {
+                ++mSyncFailures;
+                std::cerr << error << std::endl;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                // Nothing is durable past a failed sync, even if later ones succeed.
+                if (!error.empty() && mError.empty())
+                    mError = error;
+                if (mError.empty())
+                    mDurable = target;
+            }
+            mCondition.notify_all();
+        }
+    }
+
+    /**
+     * @return false with errno set if the directory could not be opened or synced.
+     */
+    bool SyncDirectory(const std::string& directory)
+    {
+        if (directory.empty())
+            return fsync(mDirectory) == 0;
+
+        int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        int result = fsync(fd);
+        int error = errno;
+        close(fd);
+        errno = error;
+        return result == 0;
+    }
+
+    [[noreturn]] void Fail(const char* what, int error)
+    {
+        ++mSyncFailures;
+        std::string message = std::string(what) + ": " + strerror(error);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mError.empty())
+                mError = message;
+        }
+        throw std::runtime_error(message);
+    }
+
+    void Measure(std::chrono::steady_clock::time_point start, size_t files)
+    {
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ++mSyncs;
+        mSyncedFiles += files;
+        mLatencyTotal += latency;
+        Metrics::Max(mLatencyMax, latency);
+    }
+
+    // Commits early rather than run out of descriptors.
+    static constexpr size_t MaxPendingFiles = 512;
+
+    DurabilityOptions mOptions;
+    int mDirectory;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<int> mPending;
+    std::vector<int> mRegistered;
+    std::set<std::string> mDirectories;
+    uint64_t mWritten;
+    uint64_t mDurable;
+    // The first failed sync; with group commit thrown to the writer from then on.
+    std::string mError;
+    bool mStopped;
+    std::atomic<uint64_t>& mSyncs;
+    std::atomic<uint64_t>& mSyncFailures;
+    std::atomic<uint64_t>& mSyncedFiles;
+    std::atomic<uint64_t>& mLatencyTotal;
+    std::atomic<uint64_t>& mLatencyMax;
+    std::thread mThread;
+};
+
+} // namespace bulk
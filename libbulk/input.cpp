@@ -0,0 +1,99 @@
+#include "input.h"
+
+namespace bulk
+{
+
+void ProcessLines(std::string_view data, CommandProcessor& processor, const ShutdownWatcher* shutdown)
+{
+    while (!data.empty() && !(shutdown && shutdown->Requested()))
+    {
+        auto end = static_cast<const char*>(memchr(data.data(), '\n', data.size()));
+        size_t length = end ? static_cast<size_t>(end - data.data()) : data.size();
+        processor.ProcessCommand(Command{data.substr(0, length), {}});
+        data.remove_prefix(end ? length + 1 : length);
+    }
+}
+
+void ProcessStream(int fd, CommandProcessor& processor, const ShutdownWatcher* shutdown)
+{
+    const size_t ReadSize = 64 * 1024;
+    const int TickInterval = 100;
+    std::string buffer;
+    size_t size = 0;
+    pollfd fds[] = {{fd, POLLIN, 0}, {shutdown ? shutdown->WakeFd() : -1, POLLIN, 0}};
+    while (!(shutdown && shutdown->Requested()))
+    {
+        int ready = poll(fds, fds[1].fd == -1 ? 1 : 2, TickInterval);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("Cannot wait for input: ") + strerror(errno));
+        }
+        if (ready == 0)
+        {
+            processor.Tick();
+            continue;
+        }
+        if (shutdown && shutdown->Requested())
+            break;
+
+        if (buffer.size() < size + ReadSize)
+        {
+            auto previous = buffer.size();
+            buffer.resize(size + ReadSize);
+            MemoryAccountant::Instance().Add(MemoryAccountant::Pool::Input, buffer.size() - previous);
+        }
+        ssize_t count = read(fd, &buffer[size], ReadSize);
+        if (count == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            throw std::runtime_error(std::string("Cannot read input: ") + strerror(errno));
+        }
+        if (count == 0)
+        {
+            ProcessLines(std::string_view(buffer.data(), size), processor, shutdown);
+            break;
+        }
+
+        std::string_view data(buffer.data(), size + count);
+        auto last = static_cast<const char*>(memrchr(data.data() + size, '\n', count));
+        if (last)
+        {
+            size_t complete = last - data.data() + 1;
+            ProcessLines(data.substr(0, complete), processor, shutdown);
+            size = data.size() - complete;
+            memmove(&buffer[0], data.data() + complete, size);
+        }
+        else
+            size = data.size();
+    }
+    MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Input, buffer.size());
+}
+
+void ProcessFile(const std::string& path, CommandProcessor& processor, const ShutdownWatcher* shutdown)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+    try
+    {
+        if (MappedFile::Mappable(fd, path))
+        {
+            MappedFile file(fd, path);
+            ProcessLines(file.Data(), processor, shutdown);
+        }
+        else
+            ProcessStream(fd, processor, shutdown);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+} // namespace bulk
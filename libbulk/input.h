@@ -0,0 +1,600 @@
+#pragma once
+
+#include "clock.h"
+#include "core.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bulk
+{
+
+class ConsoleInput : public CommandProcessor
+{
+public:
+    ConsoleInput(CommandProcessor* nextCommandProcessor = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mBlockDepth(0)
+    {
+    }
+
+    void ProcessCommand(const Command& command) override
+    {
+        if (mNextCommandProcessor)
+        {
+            if (command.Text == "{")
+            {
+                if (mBlockDepth++ == 0)
+                    mNextCommandProcessor->StartBlock();
+            }
+            else if (command.Text == "}")
+            {
+                if (--mBlockDepth == 0)
+                    mNextCommandProcessor->FinishBlock();
+            }
+            else
+                mNextCommandProcessor->ProcessCommand(command);
+        }
+    }
+
+private:
+    int mBlockDepth;
+};
+
+/**
+ * @brief Turns SIGINT and SIGTERM into an orderly shutdown.
+ *
+ * The signals are blocked in every thread, so it has to be created before any
+ * other thread, and are read from a signalfd by a watcher thread. A signal
+ * makes input loops stop at the next line and wakes up a reader waiting for
+ * stdin, after which the usual teardown flushes the pending bulk and drains
+ * the sinks. Should that take longer than the deadline, or a second signal
+ * arrive, the process exits at once; a journal still allows recovery then.
+ * Given a reload handler, SIGHUP is caught as well and runs it on the watcher
+ * thread.
+ */
+class ShutdownWatcher
+{
+public:
+    explicit ShutdownWatcher(std::chrono::milliseconds deadline, std::function<void()> reload = {})
+        : mDeadline(deadline)
+        , mReload(std::move(reload))
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        if (mReload)
+            sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, &mPreviousSignals);
+
+        mSignalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+        mWakeFd = eventfd(0, EFD_CLOEXEC);
+        mStopFd = eventfd(0, EFD_CLOEXEC);
+        if (mSignalFd == -1 || mWakeFd == -1 || mStopFd == -1)
+        {
+            int error = errno;
+            Close();
+            throw std::runtime_error(std::string("Cannot watch signals: ") + strerror(error));
+        }
+        mThread = std::thread([this]() { Run(); });
+    }
+
+    ~ShutdownWatcher()
+    {
+        uint64_t value = 1;
+        if (write(mStopFd, &value, sizeof(value)) == -1)
+            std::cerr << "Cannot stop signal watcher: " << strerror(errno) << std::endl;
+        mThread.join();
+        Close();
+    }
+
+    ShutdownWatcher(const ShutdownWatcher&) = delete;
+    ShutdownWatcher& operator=(const ShutdownWatcher&) = delete;
+
+    bool Requested() const
+    {
+        return mRequested.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Becomes readable once shutdown is requested.
+     */
+    int WakeFd() const
+    {
+        return mWakeFd;
+    }
+
+private:
+    /**
+     * @brief Closes the descriptors and unblocks the signals again.
+     */
+    void Close()
+    {
+        for (int fd : {mSignalFd, mWakeFd, mStopFd})
+        {
+            if (fd != -1)
+                close(fd);
+        }
+        pthread_sigmask(SIG_SETMASK, &mPreviousSignals, nullptr);
+    }
+
+    void Run()
+    {
+        pollfd fds[] = {{mSignalFd, POLLIN, 0}, {mStopFd, POLLIN, 0}};
+        int timeout = -1;
+        for (;;)
+        {
+            int ready = poll(fds, 2, timeout);
+            if (ready == -1 && errno == EINTR)
+                continue;
+            if (fds[1].revents)
+                break;
+            if (ready == 0)
+            {
+                std::cerr << "Shutdown deadline exceeded." << std::endl;
+                _exit(1);
+            }
+
+            signalfd_siginfo info;
+            if (read(mSignalFd, &info, sizeof(info)) != sizeof(info))
+                continue;
+            if (info.ssi_signo == SIGHUP)
+            {
+                mReload();
+                continue;
+            }
+            if (Requested())
+            {
+                std::cerr << "Forced shutdown." << std::endl;
+                _exit(1);
+            }
+            mRequested = true;
+            uint64_t value = 1;
+            if (write(mWakeFd, &value, sizeof(value)) == -1)
+                std::cerr << "Cannot wake up input: " << strerror(errno) << std::endl;
+            timeout = static_cast<int>(mDeadline.count());
+        }
+    }
+
+    std::atomic<bool> mRequested{false};
+    std::chrono::milliseconds mDeadline;
+    std::function<void()> mReload;
+    sigset_t mPreviousSignals;
+    int mSignalFd;
+    int mWakeFd;
+    int mStopFd;
+    std::thread mThread;
+};
+
+/**
+ * @brief Read-only mapping of an input file.
+ *
+ * A file that cannot be mapped, such as a pipe, /dev/stdin or a process
+ * substitution, whose size is not known up front, is read into memory instead.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+        : mData(nullptr)
+        , mSize(0)
+        , mMapped(false)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        try
+        {
+            Load(fd, path);
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    /**
+     * @brief Maps or reads the open file, leaving the descriptor to the caller.
+     */
+    MappedFile(int fd, const std::string& path)
+        : mData(nullptr)
+        , mSize(0)
+        , mMapped(false)
+    {
+        Load(fd, path);
+    }
+
+    ~MappedFile()
+    {
+        if (mMapped)
+            munmap(mData, mSize);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view Data() const
+    {
+        if (!mMapped)
+            return mContents;
+        return std::string_view(static_cast<const char*>(mData), mSize);
+    }
+
+    /**
+     * @brief Whether the descriptor refers to a regular file, which is mapped rather than read.
+     */
+    static bool Mappable(int fd, const std::string& path)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw std::runtime_error("Cannot stat " + path + ": " + strerror(errno));
+        return S_ISREG(st.st_mode);
+    }
+
+    /**
+     * @brief As above by path; false if the file cannot be examined, so that opening it reports why.
+     */
+    static bool Mappable(const std::string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+private:
+    void Load(int fd, const std::string& path)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw std::runtime_error("Cannot stat " + path + ": " + strerror(errno));
+        if (!S_ISREG(st.st_mode))
+        {
+            Read(fd, path);
+            return;
+        }
+
+        mSize = static_cast<size_t>(st.st_size);
+        if (mSize == 0)
+            return;
+
+        mData = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mData == MAP_FAILED)
+            throw std::runtime_error("Cannot map " + path + ": " + strerror(errno));
+        mMapped = true;
+        madvise(mData, mSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        // Only honoured for file mappings by kernels with read-only THP for page cache.
+        madvise(mData, mSize, MADV_HUGEPAGE);
+#endif
+    }
+
+    void Read(int fd, const std::string& path)
+    {
+        const size_t ReadSize = 64 * 1024;
+        for (;;)
+        {
+            auto size = mContents.size();
+            mContents.resize(size + ReadSize);
+            ssize_t count = read(fd, &mContents[size], ReadSize);
+            if (count == -1 && errno == EINTR)
+                count = 0;
+            else if (count == -1)
+                throw std::runtime_error("Cannot read " + path + ": " + strerror(errno));
+            else if (count == 0)
+            {
+                mContents.resize(size);
+                return;
+            }
+            mContents.resize(size + count);
+        }
+    }
+
+    void* mData;
+    size_t mSize;
+    bool mMapped;
+    std::string mContents;
+};
+
+/**
+ * @brief Feeds newline-separated commands to the processor without copying them.
+ *
+ * Matches std::getline: a missing trailing newline still ends the last command.
+ * Stops early when the watcher, if any, has shutdown requested.
+ */
+void ProcessLines(std::string_view data, CommandProcessor& processor, const ShutdownWatcher* shutdown = nullptr);
+
+/**
+ * @brief Feeds the lines read from the descriptor to the processor.
+ *
+ * Waits for input together with the shutdown wake-up, so that a signal ends
+ * reading even while no input arrives; a partial line is dropped then. While
+ * no input arrives the processor is ticked, so that time limits expire.
+ */
+void ProcessStream(int fd, CommandProcessor& processor, const ShutdownWatcher* shutdown = nullptr);
+
+/**
+ * @brief Feeds an input file to the processor, mapped if it is a regular file
+ * and read as a stream otherwise.
+ */
+void ProcessFile(const std::string& path, CommandProcessor& processor, const ShutdownWatcher* shutdown = nullptr);
+
+/**
+ * @brief Forms the bulks of a single input on several threads.
+ *
+ * The input is cut at line boundaries into one chunk per thread and processed
+ * in windows so that memory stays bounded. Brace depth decides everything
+ * ConsoleInput and BatchCommandProcessor do: a bulk is forced while the depth
+ * is positive, and blocks start and finish on 0 -> 1 and 1 -> 0 transitions.
+ * So the chunks are scanned in parallel for their depth change, a prefix sum
+ * gives every chunk its starting depth, a second parallel scan counts the
+ * static commands left pending at the end of each chunk, and a sequential
+ * pass over those counts tells each chunk how many commands of the current
+ * static bulk precede it. With that carry every chunk forms its bulks
+ * independently; only the pieces of bulks straddling chunk boundaries are
+ * joined sequentially. The result is identical to the sequential path: a
+ * bulk is stamped when a worker reads its first command, and the stamp goes
+ * with the piece holding that command.
+ */
+class SplitBulkFormer
+{
+public:
+    SplitBulkFormer(int bulkSize, Clock& clock, size_t jobs, CommandProcessor* nextCommandProcessor)
+        : mBulkSize(static_cast<size_t>(bulkSize))
+        , mClock(clock)
+        , mJobs(jobs)
+        , mNextCommandProcessor(nextCommandProcessor)
+        , mDepth(0)
+        , mCarry(0)
+    {
+    }
+
+    void Process(std::string_view data, const ShutdownWatcher& shutdown)
+    {
+        while (!data.empty() && !shutdown.Requested())
+        {
+            std::vector<std::string_view> chunks;
+            for (size_t i = 0; i < mJobs && !data.empty(); ++i)
+            {
+                chunks.push_back(CutChunk(data, ChunkSize));
+                data.remove_prefix(chunks.back().size());
+            }
+            ProcessWindow(chunks);
+        }
+
+        if (mDepth <= 0)
+            Dump(mPending);
+        Deliver();
+    }
+
+private:
+    static constexpr size_t ChunkSize = 16 * 1024 * 1024;
+
+    /**
+     * @brief Commands of one bulk, or of the part of a bulk inside a chunk.
+     */
+    struct Piece
+    {
+        CommandList Commands;
+        std::string Text;
+        std::chrono::system_clock::time_point Timestamp;
+
+        void Append(std::string_view text, Clock& clock)
+        {
+            if (!Commands.empty())
+                Text.append(", ");
+            else
+                Timestamp = clock.Now();
+            Text.append(text);
+            Commands.push_back(text);
+        }
+
+        void Append(Piece& piece)
+        {
+            if (piece.Commands.empty())
+                return;
+            if (!Commands.empty())
+                Text.append(", ");
+            else
+                Timestamp = piece.Timestamp;
+            Text.append(piece.Text);
+            Commands.Append(piece.Commands);
+        }
+    };
+
+    static std::string_view CutChunk(std::string_view data, size_t size)
+    {
+        if (data.size() <= size)
+            return data;
+        auto end = static_cast<const char*>(memchr(data.data() + size, '\n', data.size() - size));
+        return end ? data.substr(0, end - data.data() + 1) : data;
+    }
+
+    template <typename Function>
+    static void ForEachLine(std::string_view data, Function function)
+    {
+        while (!data.empty())
+        {
+            auto end = static_cast<const char*>(memchr(data.data(), '\n', data.size()));
+            size_t length = end ? static_cast<size_t>(end - data.data()) : data.size();
+            function(data.substr(0, length));
+            data.remove_prefix(end ? length + 1 : length);
+        }
+    }
+
+    template <typename Function>
+    static void ParallelFor(size_t count, Function function)
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; ++i)
+            threads.emplace_back(function, i);
+        if (count != 0)
+            function(0);
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    void ProcessWindow(const std::vector<std::string_view>& chunks)
+    {
+        size_t count = chunks.size();
+
+        std::vector<long long> depths(count + 1);
+        ParallelFor(count, [&](size_t i)
+        {
+            long long delta = 0;
+            ForEachLine(chunks[i], [&](std::string_view line)
+            {
+                if (line == "{")
+                    ++delta;
+                else if (line == "}")
+                    --delta;
+            });
+            depths[i + 1] = delta;
+        });
+        depths[0] = mDepth;
+        for (size_t i = 0; i < count; ++i)
+            depths[i + 1] += depths[i];
+
+        // Static commands pending at the end of a chunk, and whether a block
+        // boundary within it dumped everything that came before.
+        std::vector<size_t> tails(count);
+        std::vector<char> boundaries(count);
+        ParallelFor(count, [&](size_t i)
+        {
+            long long depth = depths[i];
+            size_t tail = 0;
+            bool boundary = false;
+            ForEachLine(chunks[i], [&](std::string_view line)
+            {
+                if (line == "{")
+                {
+                    if (depth++ == 0)
+                    {
+                        boundary = true;
+                        tail = 0;
+                    }
+                }
+                else if (line == "}")
+                {
+                    if (--depth == 0)
+                    {
+                        boundary = true;
+                        tail = 0;
+                    }
+                }
+                else if (depth <= 0 && ++tail >= mBulkSize)
+                    tail = 0;
+            });
+            tails[i] = tail;
+            boundaries[i] = boundary;
+        });
+        std::vector<size_t> carries(count + 1);
+        carries[0] = mCarry;
+        for (size_t i = 0; i < count; ++i)
+            carries[i + 1] = boundaries[i] ? tails[i] : (carries[i] + tails[i]) % mBulkSize;
+
+        // Every chunk yields the continuation of the bulk open before it,
+        // the bulks it completes, and the bulk left open at its end.
+        std::vector<std::vector<Piece>> pieces(count);
+        ParallelFor(count, [&](size_t i)
+        {
+            long long depth = depths[i];
+            size_t pending = carries[i];
+            auto& result = pieces[i];
+            result.emplace_back();
+            ForEachLine(chunks[i], [&](std::string_view line)
+            {
+                if (line == "{")
+                {
+                    if (depth++ == 0)
+                    {
+                        result.emplace_back();
+                        pending = 0;
+                    }
+                }
+                else if (line == "}")
+                {
+                    if (--depth == 0)
+                    {
+                        result.emplace_back();
+                        pending = 0;
+                    }
+                }
+                else
+                {
+                    result.back().Append(line, mClock);
+                    if (depth <= 0 && ++pending >= mBulkSize)
+                    {
+                        result.emplace_back();
+                        pending = 0;
+                    }
+                }
+            });
+        });
+
+        for (auto& chunkPieces : pieces)
+        {
+            mPending.Append(chunkPieces.front());
+            for (size_t i = 1; i < chunkPieces.size(); ++i)
+            {
+                Dump(mPending);
+                mPending = std::move(chunkPieces[i]);
+            }
+        }
+
+        Deliver();
+        mDepth = depths[count];
+        mCarry = carries[count];
+    }
+
+    void Dump(Piece& piece)
+    {
+        if (!piece.Commands.empty())
+            mBulks.push_back(Bulk{std::move(piece.Commands), "bulk: " + piece.Text, piece.Timestamp});
+        piece = Piece();
+    }
+
+    /**
+     * @brief Passes the bulks dumped from a window on as one batch.
+     */
+    void Deliver()
+    {
+        if (mNextCommandProcessor && !mBulks.empty())
+            mNextCommandProcessor->ProcessBulks(mBulks.data(), mBulks.size());
+        mBulks.clear();
+    }
+
+    size_t mBulkSize;
+    Clock& mClock;
+    size_t mJobs;
+    CommandProcessor* mNextCommandProcessor;
+    long long mDepth;
+    size_t mCarry;
+    Piece mPending;
+    std::vector<Bulk> mBulks;
+};
+
+} // namespace bulk
@@ -0,0 +1,94 @@
+#include "journal.h"
+#include "batch.h"
+#include "console.h"
+#include "input.h"
+
+#include <climits>
+#include <utility>
+
+namespace bulk
+{
+
+/**
+ * @brief Hands out recorded timestamps, so that replayed bulks keep their original time.
+ */
+class ReplayClock : public Clock
+{
+public:
+    explicit ReplayClock(std::vector<std::chrono::system_clock::time_point> stamps)
+        : mStamps(std::move(stamps))
+        , mNext(0)
+    {
+    }
+
+    std::chrono::system_clock::time_point Now() override
+    {
+        if (mNext < mStamps.size())
+            return mStamps[mNext++];
+        return std::chrono::system_clock::now();
+    }
+
+private:
+    std::vector<std::chrono::system_clock::time_point> mStamps;
+    size_t mNext;
+};
+
+/**
+ * @brief Drops the first bulks, which a crashed run already wrote.
+ */
+class SkipProcessor : public CommandProcessor
+{
+public:
+    SkipProcessor(size_t skip, CommandProcessor* nextCommandProcessor)
+        : CommandProcessor(nextCommandProcessor)
+        , mSkip(skip)
+    {
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        if (mSkip != 0)
+            --mSkip;
+        else if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+private:
+    size_t mSkip;
+};
+
+void RecoverJournal(const std::string& path, const ReportOptions& reportOptions, ReportDirectory& directory)
+{
+    if (access(path.c_str(), F_OK) != 0)
+        return;
+
+    MappedFile file(path);
+    std::vector<Journal::Entry> entries;
+    std::vector<std::chrono::system_clock::time_point> stamps;
+    size_t skip;
+    Journal::Read(file.Data(), entries, stamps, skip);
+    if (entries.empty())
+        return;
+
+    // Static bulks end exactly where the journal says they were formed.
+    ReplayClock clock(std::move(stamps));
+    DurabilityManager durability(reportOptions.Durability, directory.Root());
+    {
+        ReportStage reportStage(std::string(), reportOptions, directory, durability);
+        ConsoleOutput consoleOutput(reportStage.Get());
+        SkipProcessor skipProcessor(skip, &consoleOutput);
+        BatchCommandProcessor batchCommandProcessor(INT_MAX, clock, &skipProcessor);
+        ConsoleInput consoleInput(&batchCommandProcessor);
+        for (const auto& entry : entries)
+        {
+            if (entry.Type == Journal::Record::Line)
+                consoleInput.ProcessCommand(Command{entry.Text, {}});
+            else
+                batchCommandProcessor.Flush();
+        }
+    }
+    // The journal is emptied next, so the recovered reports have to be on disk by then.
+    durability.WaitDurable();
+}
+
+} // namespace bulk
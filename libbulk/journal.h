@@ -0,0 +1,413 @@
+#pragma once
+
+#include "clock.h"
+#include "writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace bulk
+{
+
+struct JournalOptions
+{
+    std::string Path;
+    std::chrono::milliseconds Interval = std::chrono::milliseconds(10);
+};
+
+/**
+ * @brief Write-ahead journal of accepted input, for recovery after a crash.
+ *
+ * Input lines, bulk timestamps, formed and written bulks are appended to a
+ * buffer that a background thread writes and syncs once per interval.
+ * Whenever no command is pending, no block is open and every formed bulk was
+ * written, the journal is emptied, so it only ever holds what a crash would
+ * lose. Written bulks must be on disk before the journal says so: under
+ * durability=group the background thread waits for a group commit to cover
+ * the reports before it writes the records of written bulks or empties the
+ * journal. Replaying the lines and flushing where bulks were formed yields the
+ * same bulks with the same timestamps, whatever flush policy was in effect,
+ * and those already written are skipped.
+ *
+ * Should the journal or the reports fail to sync, the journal is left as it
+ * is, without the records of written bulks that may not be on disk, and the
+ * error is thrown to the input.
+ */
+class Journal
+{
+public:
+    enum class Record : char
+    {
+        Line = 'L',
+        Stamp = 'S',
+        Formed = 'F',
+        Written = 'W'
+    };
+
+    struct Entry
+    {
+        Record Type;
+        std::string_view Text;
+    };
+
+    /**
+     * @param durability Syncs the reports that the written bulks went to.
+     */
+    Journal(const std::string& path, std::chrono::milliseconds interval, DurabilityManager& durability)
+        : mPath(path)
+        , mInterval(interval)
+        , mDurability(durability)
+        , mDepth(0)
+        , mPendingCommands(0)
+        , mFormed(0)
+        , mWritten(0)
+        , mReset(true)
+        , mResetOffset(0)
+        , mDurabilityPending(false)
+        , mStopped(false)
+    {
+        mFile = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (mFile == -1)
+            throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+        mThread = std::thread([this]() { Run(); });
+    }
+
+    /**
+     * @brief Empties the journal; the pipeline has been torn down by now.
+     */
+    ~Journal()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+            Reset();
+        }
+        mCondition.notify_one();
+        mThread.join();
+        close(mFile);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    /**
+     * @throw std::runtime_error if the journal could not be written or synced.
+     */
+    void Line(std::string_view text)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mError.empty())
+            throw std::runtime_error(mError);
+        Append(Record::Line, text);
+        if (text == "{")
+            ++mDepth;
+        else if (text == "}")
+            --mDepth;
+        else
+            ++mPendingCommands;
+    }
+
+    void Stamp(std::chrono::system_clock::time_point timestamp)
+    {
+        int64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            timestamp.time_since_epoch()).count();
+        std::lock_guard<std::mutex> lock(mMutex);
+        Append(Record::Stamp, std::string_view(reinterpret_cast<const char*>(&nanoseconds), sizeof(nanoseconds)));
+    }
+
+    void Formed()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mFormed;
+        mPendingCommands = 0;
+        Append(Record::Formed, std::string_view());
+        ResetIfIdle();
+    }
+
+    void Written()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mWritten;
+        mDurabilityPending = true;
+        Append(Record::Written, std::string_view());
+        ResetIfIdle();
+    }
+
+    /**
+     * @brief Reads a journal left behind by a crashed run.
+     *
+     * @param entries Receives the lines and the points where bulks were formed.
+     * @param skip Receives the number of bulks that were already written.
+     */
+    static void Read(std::string_view data, std::vector<Entry>& entries,
+        std::vector<std::chrono::system_clock::time_point>& stamps, size_t& skip)
+    {
+        skip = 0;
+        while (data.size() >= RecordHeaderSize)
+        {
+            uint32_t size;
+            memcpy(&size, data.data() + 1, sizeof(size));
+            if (data.size() < RecordHeaderSize + size)
+                break;
+            auto payload = data.substr(RecordHeaderSize, size);
+            switch (static_cast<Record>(data[0]))
+            {
+            case Record::Line:
+            case Record::Formed:
+                entries.push_back(Entry{static_cast<Record>(data[0]), payload});
+                break;
+            case Record::Stamp:
+                if (size == sizeof(int64_t))
+                {
+                    int64_t nanoseconds;
+                    memcpy(&nanoseconds, payload.data(), sizeof(nanoseconds));
+                    stamps.emplace_back(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                        std::chrono::nanoseconds(nanoseconds)));
+                }
+                break;
+            case Record::Written:
+                ++skip;
+                break;
+            }
+            data.remove_prefix(RecordHeaderSize + size);
+        }
+    }
+
+private:
+    static constexpr size_t RecordHeaderSize = 1 + sizeof(uint32_t);
+
+    void Append(Record type, std::string_view payload)
+    {
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        mBuffer.push_back(static_cast<char>(type));
+        mBuffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        mBuffer.append(payload);
+    }
+
+    void ResetIfIdle()
+    {
+        // Like ConsoleInput, an unbalanced } leaves the depth negative, with no block open.
+        if (mDepth <= 0 && mPendingCommands == 0 && mFormed == mWritten)
+            Reset();
+    }
+
+    /**
+     * @brief Drops everything journaled; the writer truncates the file before writing on.
+     *
+     * The buffered records are only dropped by the writer, once the reports
+     * of the written bulks are known to be on disk.
+     */
+    void Reset()
+    {
+        mReset = true;
+        mResetOffset = mBuffer.size();
+        mFormed = mWritten = 0;
+    }
+
+    void Run()
+    {
+        std::string buffer;
+        bool stopped = false;
+        while (!stopped)
+        {
+            bool reset;
+            size_t resetOffset;
+            bool durabilityPending;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait_for(lock, mInterval, [this]() { return mStopped; });
+                stopped = mStopped;
+                if (!mError.empty() || (mBuffer.empty() && !mReset))
+                    continue;
+                buffer.swap(mBuffer);
+                reset = mReset;
+                resetOffset = mResetOffset;
+                durabilityPending = mDurabilityPending;
+                mReset = false;
+                mResetOffset = 0;
+                mDurabilityPending = false;
+            }
+
+            std::string error;
+            if (durabilityPending)
+            {
+                try
+                {
+                    mDurability.WaitDurable();
+                }
+                catch (const std::exception& e)
+                {
+                    error = e.what();
+                    reset = false;
+                    DropWritten(buffer);
+                }
+            }
+            if (reset)
+                buffer.erase(0, resetOffset);
+
+            try
+            {
+                if (reset && ftruncate(mFile, 0) == -1)
+                    throw std::runtime_error("Cannot truncate " + mPath + ": " + strerror(errno));
+                WriteAll(mFile, buffer, mPath);
+                if (fdatasync(mFile) == -1)
+                    throw std::runtime_error("Cannot sync " + mPath + ": " + strerror(errno));
+            }
+            catch (const std::exception& e)
+            {
+                if (error.empty())
+                    error = e.what();
+            }
+            buffer.clear();
+
+            if (!error.empty())
+            {
+                std::cerr << error << std::endl;
+                std::lock_guard<std::mutex> lock(mMutex);
+                mError = error;
+            }
+        }
+    }
+
+    /**
+     * @brief Removes the records of written bulks, whose reports may not be on disk.
+     */
+    static void DropWritten(std::string& buffer)
+    {
+        size_t kept = 0;
+        for (size_t offset = 0; offset + RecordHeaderSize <= buffer.size(); )
+        {
+            uint32_t size;
+            memcpy(&size, buffer.data() + offset + 1, sizeof(size));
+            size_t length = RecordHeaderSize + size;
+            if (static_cast<Record>(buffer[offset]) != Record::Written)
+            {
+                memmove(&buffer[kept], buffer.data() + offset, length);
+                kept += length;
+            }
+            offset += length;
+        }
+        buffer.resize(kept);
+    }
+
+    std::string mPath;
+    std::chrono::milliseconds mInterval;
+    DurabilityManager& mDurability;
+    int mFile;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::string mBuffer;
+    long long mDepth;
+    size_t mPendingCommands;
+    size_t mFormed;
+    size_t mWritten;
+    bool mReset;
+    // Size of the buffer when it was last reset, what the writer drops along with the file.
+    size_t mResetOffset;
+    // Written bulks were journaled since the last write, so their reports have to be synced first.
+    bool mDurabilityPending;
+    // Why the journal stopped, thrown to the input.
+    std::string mError;
+    bool mStopped;
+    std::thread mThread;
+};
+
+/**
+ * @brief Journals input lines on their way to ConsoleInput.
+ */
+class JournalInput : public CommandProcessor
+{
+public:
+    JournalInput(Journal& journal, CommandProcessor* nextCommandProcessor)
+        : CommandProcessor(nextCommandProcessor)
+        , mJournal(journal)
+    {
+    }
+
+    void ProcessCommand(const Command& command) override
+    {
+        mJournal.Line(command.Text);
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessCommand(command);
+    }
+
+private:
+    Journal& mJournal;
+};
+
+/**
+ * @brief Journals bulks as they are formed or, behind ReportWriter, written.
+ */
+class JournalMarker : public CommandProcessor
+{
+public:
+    JournalMarker(Journal& journal, bool written, CommandProcessor* nextCommandProcessor = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mJournal(journal)
+        , mWritten(written)
+    {
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        if (mWritten)
+            mJournal.Written();
+        else
+            mJournal.Formed();
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+private:
+    Journal& mJournal;
+    bool mWritten;
+};
+
+/**
+ * @brief Journals the timestamp of every bulk as the batch processor reads it.
+ */
+class JournalClock : public Clock
+{
+public:
+    JournalClock(Clock& clock, Journal& journal)
+        : mClock(clock)
+        , mJournal(journal)
+    {
+    }
+
+    std::chrono::system_clock::time_point Now() override
+    {
+        auto now = mClock.Now();
+        mJournal.Stamp(now);
+        return now;
+    }
+
+private:
+    Clock& mClock;
+    Journal& mJournal;
+};
+
+/**
+ * @brief Forms and writes the bulks a crashed run left in its journal.
+ *
+ * An unterminated block is discarded, just as at the end of input.
+ */
+void RecoverJournal(const std::string& path, const ReportOptions& reportOptions, ReportDirectory& directory);
+
+} // namespace bulk
@@ -0,0 +1,15 @@
+#include "plugins.h"
+
+namespace bulk
+{
+
+std::vector<std::unique_ptr<PluginSink>> LoadPlugins(const std::vector<PluginOptions>& options, size_t queueSize,
+    const BackpressureOptions& backpressure, std::chrono::milliseconds deadline)
+{
+    std::vector<std::unique_ptr<PluginSink>> plugins;
+    for (const auto& plugin : options)
+        plugins.push_back(std::make_unique<PluginSink>(plugin, queueSize, backpressure, deadline));
+    return plugins;
+}
+
+} // namespace bulk
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "bulk_plugin.h"
+#include "async.h"
+
+#include <dlfcn.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bulk
+{
+
+struct PluginOptions
+{
+    std::string Path;
+    std::string Config;
+};
+
+/**
+ * @brief Sink implemented by a plugin, see bulk_plugin.h.
+ *
+ * Deliver() queues a copy of the bulk; a delivery thread passes everything
+ * queued since its last call to the plugin as one batch and keeps batches
+ * reported pending until the plugin completes them. A full queue blocks or
+ * sheds as the backpressure options say. On shutdown, bulks still queued or
+ * pending once the deadline has passed are abandoned and counted.
+ */
+class PluginSink
+{
+public:
+    /**
+     * @param queueSize Bulks that may wait for the delivery thread, 0 for no limit.
+     * @param deadline Time allowed on shutdown for delivering and completing what is left.
+     */
+    PluginSink(const PluginOptions& options, size_t queueSize, const BackpressureOptions& backpressure,
+        std::chrono::milliseconds deadline)
+        : mPath(options.Path)
+        , mHandle(dlopen(options.Path.c_str(), RTLD_NOW | RTLD_LOCAL))
+        , mPlugin(nullptr)
+        , mInstance(nullptr)
+        , mDeadline(deadline)
+        , mQueueBytes(0)
+        , mSequence(0)
+        , mStopped(false)
+    {
+        if (!mHandle)
+            throw std::runtime_error("Cannot load plugin " + mPath + ": " + dlerror());
+        auto entry = reinterpret_cast<bulk_plugin_entry_function>(dlsym(mHandle, BULK_PLUGIN_ENTRY));
+        mPlugin = entry ? entry() : nullptr;
+        if (!mPlugin || mPlugin->abi_version != BULK_PLUGIN_ABI_VERSION || !mPlugin->open || !mPlugin->write ||
+            !mPlugin->close)
+        {
+            dlclose(mHandle);
+            throw std::runtime_error("Incompatible plugin " + mPath);
+        }
+        mName = mPlugin->name && *mPlugin->name ? mPlugin->name : mPath;
+
+        mHost.context = this;
+        mHost.complete = [](void* context, uint64_t sequence, int status)
+        {
+            static_cast<PluginSink*>(context)->Complete(sequence, status);
+        };
+        if (mPlugin->open(options.Config.c_str(), &mHost, &mInstance) != BULK_OK)
+        {
+            dlclose(mHandle);
+            throw std::runtime_error("Cannot open plugin " + mName);
+        }
+
+        std::string prefix = "plugin." + mName;
+        mBackpressure = std::make_unique<Backpressure>(backpressure, queueSize, prefix);
+        mBatches = &Metrics::Instance().Get(prefix + ".batches");
+        mBulks = &Metrics::Instance().Get(prefix + ".bulks");
+        mFailures = &Metrics::Instance().Get(prefix + ".failed_batches");
+        mAbandoned = &Metrics::Instance().Get(prefix + ".abandoned_bulks");
+        mThread = std::thread([this]() { Run(); });
+    }
+
+    ~PluginSink()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+            mStopDeadline = std::chrono::steady_clock::now() + mDeadline;
+        }
+        mCondition.notify_all();
+        mThread.join();
+        // Abandoned batches are only freed with the sink, once close() stopped the plugin.
+        mPlugin->close(mInstance);
+        dlclose(mHandle);
+    }
+
+    PluginSink(const PluginSink&) = delete;
+    PluginSink& operator=(const PluginSink&) = delete;
+
+    void Deliver(const Bulk* bulks, size_t count)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (mBackpressure->Admit(lock, mCondition, mCondition, [this]() { return mQueue.size(); }))
+                {
+                    mQueue.push_back(bulks[i]);
+                    mQueueBytes += MemoryUsage(bulks[i]);
+                    MemoryAccountant::Instance().Add(MemoryAccountant::Pool::Queue, MemoryUsage(bulks[i]));
+                }
+            }
+        }
+        mCondition.notify_all();
+    }
+
+private:
+    /**
+     * @brief Bulks delivered together, with the views the plugin reads.
+     */
+    struct Batch
+    {
+        ~Batch()
+        {
+            MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Queue, Bytes);
+        }
+
+        size_t Bytes = 0;
+        std::vector<Bulk> Bulks;
+        std::vector<bulk_command> Commands;
+        std::vector<bulk_view> Views;
+    };
+
+    void Run()
+    {
+        for (;;)
+        {
+            auto batch = std::make_unique<Batch>();
+            uint64_t sequence;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                auto ready = [this]() { return !mQueue.empty() && mPending.size() < MaxPendingBatches; };
+                mCondition.wait(lock, [this, &ready]() { return ready() || mStopped; });
+                if (!ready())
+                {
+                    // Stopping: what is left is delivered and completed within the deadline.
+                    if (!mCondition.wait_until(lock, mStopDeadline,
+                        [this, &ready]() { return ready() || (mQueue.empty() && mPending.empty()); }))
+                    {
+                        Abandon();
+                        return;
+                    }
+                    if (!ready())
+                        return;
+                }
+                batch->Bulks.swap(mQueue);
+                batch->Bytes = mQueueBytes;
+                mQueueBytes = 0;
+                sequence = ++mSequence;
+            }
+            mCondition.notify_all();
+
+            size_t commands = 0;
+            for (const auto& bulk : batch->Bulks)
+                commands += bulk.Commands.size();
+            batch->Commands.reserve(commands);
+            for (const auto& bulk : batch->Bulks)
+            {
+                auto first = batch->Commands.size();
+                for (const auto& command : bulk.Commands)
+                    batch->Commands.push_back(bulk_command{command.data(), command.size()});
+                batch->Views.push_back(bulk_view{batch->Commands.data() + first, bulk.Commands.size(),
+                    bulk.Text.data(), bulk.Text.size(), std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    bulk.Timestamp.time_since_epoch()).count()});
+            }
+
+            ++*mBatches;
+            *mBulks += batch->Bulks.size();
+            const auto& views = batch->Views;
+            {
+                // Registered first, as the plugin may complete it before write() returns.
+                std::lock_guard<std::mutex> lock(mMutex);
+                mPending.emplace(sequence, std::move(batch));
+            }
+            int status = mPlugin->write(mInstance, views.data(), views.size(), sequence);
+            if (status != BULK_PLUGIN_PENDING)
+                Complete(sequence, status);
+        }
+    }
+
+    /**
+     * @brief Counts and reports what is still queued or pending; called with the lock held.
+     */
+    void Abandon()
+    {
+        size_t bulks = mQueue.size();
+        for (const auto& pending : mPending)
+            bulks += pending.second->Bulks.size();
+        *mAbandoned += bulks;
+        std::cerr << "Plugin " << mName << " did not complete " << mPending.size() << " batches within "
+            << mDeadline.count() << " ms; abandoning " << bulks << " bulks." << std::endl;
+        mQueue.clear();
+        MemoryAccountant::Instance().Release(MemoryAccountant::Pool::Queue, mQueueBytes);
+        mQueueBytes = 0;
+    }
+
+    void Complete(uint64_t sequence, int status)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mPending.erase(sequence) == 0)
+            {
+                std::cerr << "Plugin " << mName << " completed unknown batch " << sequence << std::endl;
+                return;
+            }
+        }
+        mCondition.notify_all();
+        if (status != BULK_OK)
+        {
+            ++*mFailures;
+            std::cerr << "Plugin " << mName << " failed a batch: " << status << std::endl;
+        }
+    }
+
+    static constexpr size_t MaxPendingBatches = 8;
+
+    std::string mPath;
+    std::string mName;
+    void* mHandle;
+    const bulk_plugin* mPlugin;
+    void* mInstance;
+    bulk_plugin_host mHost;
+    std::chrono::milliseconds mDeadline;
+    std::chrono::steady_clock::time_point mStopDeadline;
+    std::atomic<uint64_t>* mBatches;
+    std::atomic<uint64_t>* mBulks;
+    std::atomic<uint64_t>* mFailures;
+    std::atomic<uint64_t>* mAbandoned;
+    std::unique_ptr<Backpressure> mBackpressure;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<Bulk> mQueue;
+    size_t mQueueBytes;
+    std::map<uint64_t, std::unique_ptr<Batch>> mPending;
+    uint64_t mSequence;
+    bool mStopped;
+    std::thread mThread;
+};
+
+/**
+ * @brief Passes bulks to the plugins, then to the next processor.
+ *
+ * The plugins may be shared by the streams processed in parallel.
+ */
+class PluginTee : public CommandProcessor
+{
+public:
+    PluginTee(const std::vector<std::unique_ptr<PluginSink>>& plugins, CommandProcessor* nextCommandProcessor)
+        : CommandProcessor(nextCommandProcessor)
+        , mPlugins(plugins)
+    {
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        for (const auto& plugin : mPlugins)
+            plugin->Deliver(&bulk, 1);
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+    void ProcessBulks(const Bulk* bulks, size_t count) override
+    {
+        for (const auto& plugin : mPlugins)
+            plugin->Deliver(bulks, count);
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulks(bulks, count);
+    }
+
+private:
+    const std::vector<std::unique_ptr<PluginSink>>& mPlugins;
+};
+
+std::vector<std::unique_ptr<PluginSink>> LoadPlugins(const std::vector<PluginOptions>& options, size_t queueSize,
+    const BackpressureOptions& backpressure, std::chrono::milliseconds deadline);
+
+} // namespace bulk
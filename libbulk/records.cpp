@@ -0,0 +1,103 @@
+#include "records.h"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace bulk
+{
+
+uint32_t Crc32(uint32_t crc, const char* data, size_t size)
+{
+    static const auto table = []()
+    {
+        std::array<uint32_t, 256> result;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+                value = (value & 1) ? 0xedb88320 ^ (value >> 1) : value >> 1;
+            result[i] = value;
+        }
+        return result;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void EncodeBulkRecord(const Bulk& bulk, std::string& output)
+{
+    BulkRecordHeader header = BulkRecordHeader();
+    header.Magic = BulkRecordHeader::BulkMagic;
+    header.Count = static_cast<uint32_t>(bulk.Commands.size());
+    header.Flags = bulk.Continued ? BulkRecordHeader::ContinuedFlag : 0;
+    header.DataSize = bulk.Commands.Bytes().size();
+    header.Size = sizeof(header) + header.Count * sizeof(uint64_t) + header.DataSize;
+    header.Timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        bulk.Timestamp.time_since_epoch()).count();
+
+    size_t start = output.size();
+    output.resize(start + header.Size);
+    char* position = &output[start] + sizeof(header);
+    memcpy(position, bulk.Commands.Offsets().data(), header.Count * sizeof(uint64_t));
+    memcpy(position + header.Count * sizeof(uint64_t), bulk.Commands.Bytes().data(), header.DataSize);
+
+    header.Checksum = Crc32(0, reinterpret_cast<const char*>(&header), sizeof(header));
+    header.Checksum = Crc32(header.Checksum, &output[start] + sizeof(header), header.Size - sizeof(header));
+    memcpy(&output[start], &header, sizeof(header));
+}
+
+void DecodeBulkRecords(std::string_view data, const std::function<void(const Bulk&)>& callback)
+{
+    Bulk bulk;
+    std::vector<uint64_t> offsets;
+    while (!data.empty())
+    {
+        BulkRecordHeader header;
+        if (data.size() < sizeof(header))
+            throw std::runtime_error("Truncated bulk record");
+        memcpy(&header, data.data(), sizeof(header));
+        if (header.Magic != BulkRecordHeader::BulkMagic)
+            throw std::runtime_error("Invalid bulk record");
+        // Each term is checked against what is left so that a corrupted header cannot overflow the sum.
+        uint64_t available = data.size() - sizeof(header);
+        if (header.Size > data.size() || header.Count > available / sizeof(uint64_t))
+            throw std::runtime_error("Truncated bulk record");
+        uint64_t offsetsSize = uint64_t(header.Count) * sizeof(uint64_t);
+        if (header.DataSize > available - offsetsSize)
+            throw std::runtime_error("Truncated bulk record");
+        if (header.Size != sizeof(header) + offsetsSize + header.DataSize)
+            throw std::runtime_error("Invalid bulk record");
+
+        uint32_t checksum = header.Checksum;
+        header.Checksum = 0;
+        uint32_t actual = Crc32(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        actual = Crc32(actual, data.data() + sizeof(header), header.Size - sizeof(header));
+        if (actual != checksum)
+            throw std::runtime_error("Bulk record checksum mismatch");
+
+        offsets.resize(header.Count);
+        memcpy(offsets.data(), data.data() + sizeof(header), offsetsSize);
+        for (uint32_t i = 0; i < header.Count; ++i)
+        {
+            uint64_t end = i + 1 < header.Count ? offsets[i + 1] : header.DataSize;
+            if (offsets[i] > end || end > header.DataSize)
+                throw std::runtime_error("Invalid bulk record");
+        }
+        bulk.Commands.Assign(data.substr(sizeof(header) + offsetsSize, header.DataSize), offsets.data(),
+            offsets.size());
+        bulk.Timestamp = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(header.Timestamp)));
+        bulk.Continued = (header.Flags & BulkRecordHeader::ContinuedFlag) != 0;
+        callback(bulk);
+
+        data.remove_prefix(header.Size);
+    }
+}
+
+} // namespace bulk
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "bulk.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace bulk
+{
+
+/**
+ * @brief Header of a binary bulk record.
+ *
+ * The header is followed by the offset of every command within the data and
+ * by the command bytes, so a record is consumed without parsing and commands
+ * may contain any bytes. Size covers the whole record, so records are skipped
+ * without looking inside. The CRC-32 is computed over the whole record with
+ * the checksum field set to zero. Flags has ContinuedFlag set for a part of a
+ * split block other than the last.
+ */
+struct BulkRecordHeader
+{
+    static constexpr uint32_t BulkMagic = 0x4b4c5542; // "BULK"
+    static constexpr uint32_t ContinuedFlag = 1;
+
+    uint32_t Magic;
+    uint32_t Count;
+    uint64_t Size;
+    uint64_t DataSize;
+    int64_t Timestamp;
+    uint32_t Checksum;
+    uint32_t Flags;
+};
+
+static_assert(sizeof(BulkRecordHeader) == 40, "Bulk record header must be packed");
+
+uint32_t Crc32(uint32_t crc, const char* data, size_t size);
+
+/**
+ * @brief Appends the binary record of a bulk to the output.
+ */
+void EncodeBulkRecord(const Bulk& bulk, std::string& output);
+
+/**
+ * @brief Decodes consecutive binary records, verifying their checksums.
+ */
+void DecodeBulkRecords(std::string_view data, const std::function<void(const Bulk&)>& callback);
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Bulk records are written in host byte order");
+
+} // namespace bulk
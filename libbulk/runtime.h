@@ -0,0 +1,139 @@
+#pragma once
+
+#include "async.h"
+#include "compression.h"
+#include "durability.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace bulk
+{
+
+enum class ReportFormat
+{
+    Text,
+    Binary
+};
+
+enum class Sharding
+{
+    None,
+    Hour,
+    Minute,
+    Hash
+};
+
+struct ReportOptions
+{
+    ReportFormat Format = ReportFormat::Text;
+    CompressionOptions Compression;
+    DurabilityOptions Durability;
+    // Bulks that may wait for a writer on its own thread, 0 for no limit.
+    size_t QueueSize = 0;
+    BackpressureOptions Backpressure;
+    // Skip console output while the report queue is overloaded.
+    bool DegradeConsole = false;
+    // False to not write report files at all.
+    bool Enabled = true;
+    // Root of the report files, the working directory if empty.
+    std::string Directory;
+    Sharding Shard = Sharding::None;
+    size_t ShardCount = 256;
+};
+
+/**
+ * @brief When BatchCommandProcessor dumps a static bulk: once it holds
+ * BulkSize commands or, if set, BulkBytes bytes of commands or once its
+ * first command is TimeLimit old.
+ *
+ * With MaxBulkSize set the size adapts instead, starting at BulkSize and
+ * staying within [MinBulkSize, MaxBulkSize]: it grows while the sinks fall
+ * behind and shrinks while bulks take longer than TargetLatency to fill and
+ * be written.
+ *
+ * A dynamic block is oversized once it holds BlockBytes bytes of commands,
+ * if set, or the memory limit is exceeded. OversizedBlock then keeps it
+ * whole, splits it into bulks marked as continued, rejects it, or streams
+ * the rest of it to the sinks as one bulk, a slice of commands at a time.
+ */
+enum class BlockOverflow
+{
+    Keep,
+    Split,
+    Reject,
+    Stream
+};
+
+struct FlushPolicy
+{
+    int BulkSize = 0;
+    size_t BulkBytes = 0;
+    std::chrono::milliseconds TimeLimit = std::chrono::milliseconds(0);
+    int MinBulkSize = 1;
+    int MaxBulkSize = 0;
+    std::chrono::milliseconds TargetLatency = std::chrono::milliseconds(100);
+    size_t BlockBytes = 0;
+    BlockOverflow OversizedBlock = BlockOverflow::Keep;
+};
+
+/**
+ * @brief Settings that may be changed while running.
+ */
+struct RuntimeSettings
+{
+    FlushPolicy Flush;
+    ReportOptions Report;
+};
+
+/**
+ * @brief Current runtime settings, replaced as a whole on reload.
+ *
+ * Readers poll Version(), which is a single relaxed load, and fetch the
+ * settings only when it changed, at a point where applying them is safe.
+ */
+class SettingsStore
+{
+public:
+    explicit SettingsStore(const RuntimeSettings& settings)
+        : mSettings(std::make_shared<const RuntimeSettings>(settings))
+        , mVersion(1)
+    {
+    }
+
+    uint64_t Version() const
+    {
+        return mVersion.load(std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<const RuntimeSettings> Get(uint64_t& version) const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        version = mVersion;
+        return mSettings;
+    }
+
+    std::shared_ptr<const RuntimeSettings> Get() const
+    {
+        uint64_t version;
+        return Get(version);
+    }
+
+    void Set(const RuntimeSettings& settings)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSettings = std::make_shared<const RuntimeSettings>(settings);
+        ++mVersion;
+    }
+
+private:
+    mutable std::mutex mMutex;
+    std::shared_ptr<const RuntimeSettings> mSettings;
+    std::atomic<uint64_t> mVersion;
+};
+
+} // namespace bulk
@@ -0,0 +1,458 @@
+#include "settings.h"
+#include "input.h"
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <initializer_list>
+#include <stdexcept>
+#include <thread>
+
+namespace bulk
+{
+
+long long ParseNumber(const std::string& key, const std::string& value, long long min, long long max)
+{
+    long long number = 0;
+    auto result = std::from_chars(value.data(), value.data() + value.size(), number);
+    if (result.ec != std::errc() || result.ptr != value.data() + value.size())
+        throw std::invalid_argument("Invalid " + key + " '" + value + "': not an integer");
+    if (number < min || number > max)
+    {
+        throw std::invalid_argument("Invalid " + key + " '" + value + "': expected " + std::to_string(min) +
+            ".." + std::to_string(max));
+    }
+    return number;
+}
+
+static std::chrono::milliseconds ParseMilliseconds(const std::string& key, const std::string& value, long long min)
+{
+    return std::chrono::milliseconds(ParseNumber(key, value, min, INT_MAX));
+}
+
+static bool ParseBool(const std::string& key, const std::string& value)
+{
+    if (value == "true" || value == "false")
+        return value == "true";
+    throw std::invalid_argument("Invalid " + key + " '" + value + "': expected true or false");
+}
+
+/**
+ * @brief Picks one of the names; the value is its index.
+ */
+static size_t ParseChoice(const std::string& key, const std::string& value, std::initializer_list<const char*> names)
+{
+    size_t index = 0;
+    std::string expected;
+    for (auto name : names)
+    {
+        if (value == name)
+            return index;
+        expected += (index++ == 0 ? "" : index == names.size() ? " or " : ", ") + std::string(name);
+    }
+    throw std::invalid_argument("Invalid " + key + " '" + value + "': expected " + expected);
+}
+
+/**
+ * @brief Applies <prefix>overflow, <prefix>sample, <prefix>rate or <prefix>burst.
+ *
+ * @return False if the key is none of them.
+ */
+static bool ApplyBackpressure(const std::string& key, const std::string& value, const std::string& prefix,
+    BackpressureOptions& backpressure)
+{
+    if (key.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    auto name = key.substr(prefix.size());
+    if (name == "overflow")
+        backpressure.Mode = static_cast<Overflow>(ParseChoice(key, value, {"block", "drop", "sample", "spill"}));
+    else if (name == "sample")
+        backpressure.SampleEvery = static_cast<size_t>(ParseNumber(key, value, 1, LLONG_MAX));
+    else if (name == "rate")
+        backpressure.Rate = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (name == "burst")
+        backpressure.Burst = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (name == "spill-dir")
+        backpressure.SpillDirectory = value;
+    else
+        return false;
+    return true;
+}
+
+bool ApplySetting(const std::string& key, const std::string& value, Settings& settings)
+{
+    auto& flush = settings.Runtime.Flush;
+    auto& report = settings.Runtime.Report;
+    auto& compression = report.Compression;
+    if (key == "bulk-size")
+        flush.BulkSize = static_cast<int>(ParseNumber(key, value, 1, INT_MAX));
+    else if (key == "bulk-bytes")
+        flush.BulkBytes = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "bulk-time-limit")
+        flush.TimeLimit = ParseMilliseconds(key, value, 0);
+    else if (key == "bulk-size-min")
+        flush.MinBulkSize = static_cast<int>(ParseNumber(key, value, 1, INT_MAX));
+    else if (key == "bulk-size-max")
+        flush.MaxBulkSize = static_cast<int>(ParseNumber(key, value, 0, INT_MAX));
+    else if (key == "target-latency")
+        flush.TargetLatency = ParseMilliseconds(key, value, 1);
+    else if (key == "block-limit")
+        flush.BlockBytes = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "block-overflow")
+        flush.OversizedBlock = static_cast<BlockOverflow>(ParseChoice(key, value, {"keep", "split", "reject", "stream"}));
+    else if (key == "format")
+        report.Format = static_cast<ReportFormat>(ParseChoice(key, value, {"text", "binary"}));
+    else if (key == "compress")
+        compression.Codec = static_cast<Compression>(ParseChoice(key, value, {"none", "gzip", "lz4", "zstd"}));
+    else if (key == "compress-level")
+        compression.Level = static_cast<int>(ParseNumber(key, value, -100, 22));
+    else if (key == "compress-mode")
+        compression.Segment = ParseChoice(key, value, {"file", "segment"}) == 1;
+    else if (key == "segment-size")
+        compression.SegmentSize = static_cast<size_t>(ParseNumber(key, value, 1, LLONG_MAX));
+    else if (key == "dictionary")
+    {
+        compression.Dictionary = value.empty() ? std::string() : std::string(MappedFile(value).Data());
+        compression.DictionaryPath = value;
+    }
+    else if (key == "reports")
+        report.Enabled = ParseBool(key, value);
+    else if (key == "output-dir")
+        report.Directory = value;
+    else if (key == "shard")
+        report.Shard = static_cast<Sharding>(ParseChoice(key, value, {"none", "hour", "minute", "hash"}));
+    else if (key == "shard-count")
+        report.ShardCount = static_cast<size_t>(ParseNumber(key, value, 1, 65536));
+    else if (key == "queue-size")
+        report.QueueSize = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "console-overload")
+        report.DegradeConsole = ParseChoice(key, value, {"keep", "skip"}) == 1;
+    else if (key == "durability")
+        report.Durability.Mode = static_cast<Durability>(ParseChoice(key, value, {"none", "group", "bulk"}));
+    else if (key == "group-commit-interval")
+        report.Durability.Interval = ParseMilliseconds(key, value, 1);
+    else if (key == "group-commit-syncfs")
+        report.Durability.SyncFs = ParseBool(key, value);
+    else if (key == "clock")
+    {
+        ParseChoice(key, value, {"system", "coarse", "tsc"});
+        settings.Clock = value;
+    }
+    else if (key == "jobs")
+    {
+        settings.Jobs = value == "auto" ? std::max(1u, std::thread::hardware_concurrency()) :
+            static_cast<size_t>(ParseNumber(key, value, 0, 1024));
+    }
+    else if (key == "interleave")
+        settings.Interleave = static_cast<OrderedConsole::Interleave>(ParseChoice(key, value, {"file", "bulk"}));
+    else if (key == "journal")
+        settings.Journal.Path = value;
+    else if (key == "journal-interval")
+        settings.Journal.Interval = ParseMilliseconds(key, value, 1);
+    else if (key == "retention-bytes")
+        settings.Retention.MaxBytes = static_cast<uint64_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "retention-files")
+        settings.Retention.MaxFiles = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "retention-age")
+        settings.Retention.MaxAge = std::chrono::seconds(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "retention-interval")
+        settings.Retention.Interval = ParseMilliseconds(key, value, 1);
+    else if (key == "compact-age")
+        settings.Compaction.MinAge = std::chrono::seconds(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "compact-size")
+        settings.Compaction.ArchiveSize = static_cast<uint64_t>(ParseNumber(key, value, 1, LLONG_MAX));
+    else if (key == "compact-interval")
+        settings.Compaction.Interval = ParseMilliseconds(key, value, 1);
+    else if (key == "plugin")
+    {
+        auto space = value.find(' ');
+        if (value.empty() || space == 0)
+            throw std::invalid_argument("Invalid plugin '" + value + "': expected <path> [<config>]");
+        settings.Plugins.push_back(PluginOptions{value.substr(0, space),
+            space == std::string::npos ? std::string() : value.substr(space + 1)});
+    }
+    else if (key == "plugin-queue-size")
+        settings.PluginQueueSize = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "shutdown-deadline")
+        settings.ShutdownDeadline = ParseMilliseconds(key, value, 1);
+    else if (key == "memory-limit")
+        settings.MemoryLimit = static_cast<size_t>(ParseNumber(key, value, 0, LLONG_MAX));
+    else if (key == "metrics")
+        settings.Metrics = ParseBool(key, value);
+    else
+    {
+        return ApplyBackpressure(key, value, "report-", report.Backpressure) ||
+            ApplyBackpressure(key, value, "plugin-", settings.PluginBackpressure);
+    }
+    return true;
+}
+
+void ValidateSettings(const Settings& settings)
+{
+    const auto& flush = settings.Runtime.Flush;
+    if (flush.BulkSize == 0)
+        throw std::invalid_argument("Bulk size is not specified.");
+    if (flush.MaxBulkSize != 0 && flush.MinBulkSize > flush.MaxBulkSize)
+    {
+        throw std::invalid_argument("Invalid bulk-size-min " + std::to_string(flush.MinBulkSize) +
+            ": greater than bulk-size-max " + std::to_string(flush.MaxBulkSize));
+    }
+    if (!settings.Journal.Path.empty() && settings.Jobs != 0)
+        throw std::invalid_argument("The journal is not supported with jobs.");
+    const auto& report = settings.Runtime.Report;
+    const auto& compression = report.Compression;
+    if (compression.Codec != Compression::None)
+    {
+        // Levels the codecs take, indexed by Compression; 0 is the default of each.
+        const char* codecs[] = {"none", "gzip", "lz4", "zstd"};
+        const int minLevels[] = {0, -1, -100, -100};
+        const int maxLevels[] = {0, 9, 12, 22};
+        auto codec = static_cast<int>(compression.Codec);
+        if (compression.Level < minLevels[codec] || compression.Level > maxLevels[codec])
+        {
+            throw std::invalid_argument("Invalid compress-level " + std::to_string(compression.Level) + " for " +
+                codecs[codec] + ": expected " + std::to_string(minLevels[codec]) + ".." +
+                std::to_string(maxLevels[codec]));
+        }
+    }
+    // A bulk is journaled as written once its report is on disk, so the reports have to be synced, and as
+    // a whole: a segment holds on to what it compressed.
+    if (!settings.Journal.Path.empty() && (report.Durability.Mode == Durability::None || report.Compression.Segment))
+        throw std::invalid_argument("The journal needs durability=group or bulk and reports in files of their own.");
+    if (report.Backpressure.Mode == Overflow::Spill && (report.QueueSize == 0 || report.Backpressure.Rate != 0))
+        throw std::invalid_argument("report-overflow=spill needs a queue-size and no report-rate.");
+    if (flush.OversizedBlock == BlockOverflow::Split && !settings.Journal.Path.empty())
+        throw std::invalid_argument("block-overflow=split is not supported with the journal.");
+    if (flush.OversizedBlock == BlockOverflow::Stream &&
+        (report.Format == ReportFormat::Binary || report.Compression.Segment || !settings.Journal.Path.empty()))
+    {
+        throw std::invalid_argument(
+            "block-overflow=stream needs text reports in files of their own and is not supported with the journal.");
+    }
+    // Streamed blocks only reach the console and report files, so sinks that take whole bulks would miss them.
+    if (flush.OversizedBlock == BlockOverflow::Stream && !settings.Plugins.empty())
+        throw std::invalid_argument("block-overflow=stream is not supported with plugins.");
+    if (report.DegradeConsole && (!report.Enabled || (report.QueueSize == 0 && report.Backpressure.Rate == 0)))
+        throw std::invalid_argument("console-overload=skip needs report files and a queue-size or report-rate.");
+    if (settings.PluginBackpressure.Mode == Overflow::Spill)
+        throw std::invalid_argument("plugin-overflow=spill is not supported.");
+}
+
+static void PrintBackpressure(const char* prefix, const BackpressureOptions& backpressure, std::ostream& output)
+{
+    const char* modes[] = {"block", "drop", "sample", "spill"};
+    output << prefix << "overflow = " << modes[static_cast<int>(backpressure.Mode)] << '\n'
+        << prefix << "sample = " << backpressure.SampleEvery << '\n'
+        << prefix << "rate = " << backpressure.Rate << '\n'
+        << prefix << "burst = " << backpressure.Burst << '\n'
+        << prefix << "spill-dir = " << backpressure.SpillDirectory << '\n';
+}
+
+void PrintSettings(const Settings& settings, std::ostream& output)
+{
+    const auto& flush = settings.Runtime.Flush;
+    const auto& report = settings.Runtime.Report;
+    const auto& compression = report.Compression;
+    const char* codecs[] = {"none", "gzip", "lz4", "zstd"};
+    const char* durabilities[] = {"none", "group", "bulk"};
+    const char* shards[] = {"none", "hour", "minute", "hash"};
+    const char* blockOverflows[] = {"keep", "split", "reject", "stream"};
+    auto boolean = [](bool value) { return value ? "true" : "false"; };
+
+    output << "bulk-size = " << flush.BulkSize << '\n'
+        << "bulk-bytes = " << flush.BulkBytes << '\n'
+        << "bulk-time-limit = " << flush.TimeLimit.count() << '\n'
+        << "bulk-size-min = " << flush.MinBulkSize << '\n'
+        << "bulk-size-max = " << flush.MaxBulkSize << '\n'
+        << "target-latency = " << flush.TargetLatency.count() << '\n'
+        << "block-limit = " << flush.BlockBytes << '\n'
+        << "block-overflow = " << blockOverflows[static_cast<int>(flush.OversizedBlock)] << '\n'
+        << "format = " << (report.Format == ReportFormat::Text ? "text" : "binary") << '\n'
+        << "compress = " << codecs[static_cast<int>(compression.Codec)] << '\n'
+        << "compress-level = " << compression.Level << '\n'
+        << "compress-mode = " << (compression.Segment ? "segment" : "file") << '\n'
+        << "segment-size = " << compression.SegmentSize << '\n'
+        << "dictionary = " << compression.DictionaryPath << '\n'
+        << "reports = " << boolean(report.Enabled) << '\n'
+        << "output-dir = " << report.Directory << '\n'
+        << "shard = " << shards[static_cast<int>(report.Shard)] << '\n'
+        << "shard-count = " << report.ShardCount << '\n'
+        << "queue-size = " << report.QueueSize << '\n';
+    PrintBackpressure("report-", report.Backpressure, output);
+    output << "console-overload = " << (report.DegradeConsole ? "skip" : "keep") << '\n'
+        << "durability = " << durabilities[static_cast<int>(report.Durability.Mode)] << '\n'
+        << "group-commit-interval = " << report.Durability.Interval.count() << '\n'
+        << "group-commit-syncfs = " << boolean(report.Durability.SyncFs) << '\n'
+        << "clock = " << settings.Clock << '\n'
+        << "jobs = " << settings.Jobs << '\n'
+        << "interleave = " << (settings.Interleave == OrderedConsole::Interleave::File ? "file" : "bulk") << '\n'
+        << "journal = " << settings.Journal.Path << '\n'
+        << "journal-interval = " << settings.Journal.Interval.count() << '\n'
+        << "retention-bytes = " << settings.Retention.MaxBytes << '\n'
+        << "retention-files = " << settings.Retention.MaxFiles << '\n'
+        << "retention-age = " << settings.Retention.MaxAge.count() << '\n'
+        << "retention-interval = " << settings.Retention.Interval.count() << '\n'
+        << "compact-age = " << settings.Compaction.MinAge.count() << '\n'
+        << "compact-size = " << settings.Compaction.ArchiveSize << '\n'
+        << "compact-interval = " << settings.Compaction.Interval.count() << '\n';
+    for (const auto& plugin : settings.Plugins)
+        output << "plugin = " << plugin.Path << (plugin.Config.empty() ? "" : " ") << plugin.Config << '\n';
+    output << "plugin-queue-size = " << settings.PluginQueueSize << '\n';
+    PrintBackpressure("plugin-", settings.PluginBackpressure, output);
+    output
+        << "shutdown-deadline = " << settings.ShutdownDeadline.count() << '\n'
+        << "memory-limit = " << settings.MemoryLimit << '\n'
+        << "metrics = " << boolean(settings.Metrics) << std::endl;
+}
+
+void PrintUsage(std::ostream& output)
+{
+    output <<
+        "Usage: bulk [<bulk-size>] [--<setting>=<value>...] [--config=<file>] [--print-settings] [<file>...]\n"
+        "       bulk --cat [--dictionary=<file>] <report>...\n"
+        "       bulk --lookup=<time> [--dictionary=<file>] [<output-dir>...]\n"
+        "       bulk --train-dictionary=<output> <sample>...\n"
+        "\n"
+        "Commands are read from the files, or from stdin if none are given. A first\n"
+        "argument that is a number is the bulk size, which may come from the config\n"
+        "file instead.\n"
+        "Settings come from the config file, one \"<setting> = <value>\" per line,\n"
+        "then from the command line; on SIGHUP the config file is read again and\n"
+        "the settings marked * take effect at the next bulk.\n"
+        "\n"
+        "  bulk-size=<n>               * commands per static bulk\n"
+        "  bulk-bytes=<n>              * also dump a static bulk once it holds n bytes, 0 for no limit\n"
+        "  bulk-time-limit=<ms>        * also dump a static bulk once it is this old, 0 for no limit\n"
+        "  bulk-size-max=<n>           * adapt the bulk size to the sinks up to n, 0 to keep it fixed\n"
+        "  bulk-size-min=<n>           * lower bound of the adaptive bulk size\n"
+        "  target-latency=<ms>         * latency the adaptive bulk size aims for\n"
+        "  block-limit=<bytes>         * size from which a dynamic block is oversized, 0 for no limit\n"
+        "  block-overflow=keep|split|reject|stream\n"
+        "                              * what to do with an oversized block or one growing over\n"
+        "                                memory-limit: keep it whole; dump it in parts ending with\n"
+        "                                \"...\", all but the last of which stay even if the input\n"
+        "                                ends within the block; discard it; or stream it to the\n"
+        "                                console and a report file published when the block ends,\n"
+        "                                not with plugins\n"
+        "  format=text|binary          * report file format\n"
+        "  compress=none|gzip|lz4|zstd * report compression\n"
+        "  compress-level=<n>          * codec specific level, 0 for its default: gzip -1..9,\n"
+        "                                lz4 -100..12, zstd -100..22\n"
+        "  compress-mode=file|segment  * one file per bulk or segments of many bulks\n"
+        "  segment-size=<bytes>        * uncompressed size after which a segment is finished\n"
+        "  dictionary=<file>           * zstd dictionary\n"
+        "  reports=true|false            write report files\n"
+        "  output-dir=<path>             directory of the report files\n"
+        "  shard=none|hour|minute|hash   subdirectories by UTC time of the file or by hash of its name\n"
+        "  shard-count=<n>               number of hash subdirectories\n"
+        "  queue-size=<n>                bulks waiting for a compressing or syncing writer, 0 for no limit\n"
+        "  report-overflow=block|drop|sample|spill\n"
+        "                                what a full report queue does with a bulk: wait for space,\n"
+        "                                drop it, drop all but a sample or spill it to a file to be\n"
+        "                                written later; the writer gets its own thread\n"
+        "  report-sample=<n>             keep one in n bulks when sampling\n"
+        "  report-rate=<n>               bulks per second written, 0 for no limit; excess bulks overflow\n"
+        "  report-burst=<n>              bulks written at once after a quiet period, 0 for report-rate\n"
+        "  report-spill-dir=<path>       directory of the spill file, output-dir if empty\n"
+        "  console-overload=keep|skip    skip console output while the report queue overflows; the\n"
+        "                                writer gets its own thread\n"
+        "  durability=none|group|bulk    when report files are synced\n"
+        "  group-commit-interval=<ms>    how often group commit syncs\n"
+        "  group-commit-syncfs[=true]    group commit syncs the whole file system\n"
+        "  clock=system|coarse|tsc       clock timestamping the bulks; tsc uses the monotonic clock\n"
+        "                                where the time stamp counter is not invariant\n"
+        "  jobs=<n>|auto                 process the input files on n threads\n"
+        "  interleave=file|bulk          console order of files processed in parallel\n"
+        "  journal=<file>                write-ahead journal for crash recovery, needs durability=group\n"
+        "                                or bulk and compress-mode=file\n"
+        "  journal-interval=<ms>         how often the journal is flushed\n"
+        "  retention-bytes=<n>           delete the oldest report files beyond n bytes, 0 for no limit\n"
+        "  retention-files=<n>           delete the oldest report files beyond n files, 0 for no limit\n"
+        "  retention-age=<s>             delete report files older than this, 0 for no limit\n"
+        "  retention-interval=<ms>       how often the retention limits are enforced\n"
+        "  compact-age=<s>               archive bulk files older than this, 0 to keep them as they are\n"
+        "  compact-size=<bytes>          size of an archive\n"
+        "  compact-interval=<ms>         how often old bulk files are archived\n"
+        "  plugin=<path> [<config>]      sink plugin receiving every bulk, may be repeated\n"
+        "  plugin-queue-size=<n>         bulks waiting for each plugin, 0 for no limit\n"
+        "  plugin-overflow=block|drop|sample, plugin-sample=<n>, plugin-rate=<n>, plugin-burst=<n>\n"
+        "                                as for the report queue, per plugin\n"
+        "  memory-limit=<bytes>          memory for input, bulks being formed and queues, 0 for no\n"
+        "                                limit; queues beyond it count as full\n"
+        "  shutdown-deadline=<ms>        time allowed for flushing on SIGINT or SIGTERM, and for\n"
+        "                                plugins to complete their batches on exit\n"
+        "  metrics[=true]                print metrics to stderr on exit; with jobs, gauges such as\n"
+        "                                batch.bulk_size hold the value last set by any stream\n";
+}
+
+void LoadSettings(const std::string& path, Settings& settings)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::invalid_argument("Cannot open " + path);
+
+    auto trim = [](std::string text)
+    {
+        auto begin = text.find_first_not_of(" \t\r");
+        auto end = text.find_last_not_of(" \t\r");
+        return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+    };
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number)
+    {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+
+        auto separator = line.find('=');
+        try
+        {
+            if (separator == std::string::npos)
+                throw std::invalid_argument("Expected key = value");
+            auto key = trim(line.substr(0, separator));
+            if (!ApplySetting(key, trim(line.substr(separator + 1)), settings))
+                throw std::invalid_argument("Unknown setting " + key);
+        }
+        catch (const std::exception& e)
+        {
+            throw std::invalid_argument(path + ":" + std::to_string(number) + ": " + e.what());
+        }
+    }
+}
+
+void ApplyArguments(int argc, char const** argv, Settings& settings, std::vector<std::string>* inputFiles)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        // The bulk size may be left to the config file, so that the first argument is an input file then.
+        bool number = !arg.empty() && std::all_of(arg.begin() + (arg[0] == '-' ? 1 : 0), arg.end(),
+            [](char c) { return c >= '0' && c <= '9'; });
+        if (i == 1 && number)
+        {
+            ApplySetting("bulk-size", arg, settings);
+            continue;
+        }
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            if (inputFiles)
+                inputFiles->push_back(arg);
+            continue;
+        }
+        if (arg == "--print-settings" || arg.compare(0, 9, "--config=") == 0)
+            continue;
+
+        // Switches such as --metrics stand for --metrics=true.
+        auto separator = arg.find('=');
+        auto key = arg.substr(2, separator == std::string::npos ? std::string::npos : separator - 2);
+        auto value = separator == std::string::npos ? std::string("true") : arg.substr(separator + 1);
+        if (!ApplySetting(key, value, settings))
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+}
+
+} // namespace bulk
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "compaction.h"
+#include "console.h"
+#include "journal.h"
+#include "plugins.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace bulk
+{
+
+/**
+ * @brief Everything that can be configured; only Runtime is reloaded while running.
+ */
+struct Settings
+{
+    RuntimeSettings Runtime;
+    std::string Clock = "system";
+    size_t Jobs = 0;
+    OrderedConsole::Interleave Interleave = OrderedConsole::Interleave::File;
+    JournalOptions Journal;
+    RetentionOptions Retention;
+    CompactionOptions Compaction;
+    std::vector<PluginOptions> Plugins;
+    size_t PluginQueueSize = 0;
+    BackpressureOptions PluginBackpressure;
+    std::chrono::milliseconds ShutdownDeadline = std::chrono::milliseconds(5000);
+    // Bytes, 0 for no limit; one limit for the whole process.
+    size_t MemoryLimit = 0;
+    bool Metrics = false;
+};
+
+/**
+ * @brief Parses an integer setting within [min, max].
+ */
+long long ParseNumber(const std::string& key, const std::string& value, long long min, long long max);
+
+/**
+ * @brief Applies one setting, as given on the command line or in the config file.
+ *
+ * @return False if there is no such setting.
+ */
+bool ApplySetting(const std::string& key, const std::string& value, Settings& settings);
+
+/**
+ * @brief Checks the constraints between settings that ApplySetting cannot check one by one.
+ */
+void ValidateSettings(const Settings& settings);
+
+/**
+ * @brief Writes the settings as a config file that reproduces them.
+ */
+void PrintSettings(const Settings& settings, std::ostream& output);
+
+void PrintUsage(std::ostream& output);
+
+/**
+ * @brief Applies a config file of "key = value" lines; '#' starts a comment.
+ */
+void LoadSettings(const std::string& path, Settings& settings);
+
+/**
+ * @brief Applies the settings given on the command line, on top of those of a config file.
+ *
+ * @param inputFiles Receives the arguments that are not options, if not null.
+ */
+void ApplyArguments(int argc, char const** argv, Settings& settings, std::vector<std::string>* inputFiles);
+
+} // namespace bulk
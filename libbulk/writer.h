@@ -0,0 +1,591 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+namespace bulk
+{
+
+/**
+ * @brief Report root and its shard subdirectories.
+ *
+ * Time shards are named after the UTC hour or minute of the file, such as
+ * 2018012911 or 201801291107; hash shards after the CRC-32 of the file name
+ * modulo the shard count, in hex. A shard is created when its first file is
+ * written and remembered, so that there is no mkdir per file; with durable
+ * reports the root is synced after a shard was added to it.
+ */
+class ReportDirectory
+{
+public:
+    explicit ReportDirectory(const ReportOptions& options = ReportOptions())
+        : mRoot(options.Directory)
+        , mSharding(options.Shard)
+        , mShardCount(options.ShardCount)
+        , mDurable(options.Durability.Mode != Durability::None)
+    {
+        if (mRoot.empty())
+            return;
+
+        for (auto end = mRoot.find('/', 1); ; end = mRoot.find('/', end + 1))
+        {
+            auto directory = mRoot.substr(0, end);
+            if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+                throw std::runtime_error("Cannot create " + directory + ": " + strerror(errno));
+            if (end == std::string::npos)
+                break;
+        }
+    }
+
+    /**
+     * @brief The root as given to DurabilityManager.
+     */
+    std::string Root() const
+    {
+        return mRoot.empty() ? std::string(".") : mRoot;
+    }
+
+    /**
+     * @brief Returns the directory the file goes to, empty for the working
+     * directory, creating its shard on first use.
+     */
+    std::string Get(const std::string& name, std::chrono::system_clock::time_point timestamp)
+    {
+        if (mSharding == Sharding::None)
+            return mRoot;
+
+        char shard[16];
+        if (mSharding == Sharding::Hash)
+        {
+            int digits = 1;
+            for (size_t count = mShardCount - 1; count > 0xf; count >>= 4)
+                ++digits;
+            snprintf(shard, sizeof(shard), "%0*x", digits,
+                static_cast<unsigned>(Crc32(0, name.data(), name.size()) % mShardCount));
+        }
+        else
+        {
+            auto time = std::chrono::system_clock::to_time_t(timestamp);
+            tm utc;
+            gmtime_r(&time, &utc);
+            strftime(shard, sizeof(shard), mSharding == Sharding::Hour ? "%Y%m%d%H" : "%Y%m%d%H%M", &utc);
+        }
+
+        std::string directory = mRoot.empty() ? std::string(shard) : mRoot + '/' + shard;
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mCreated.count(directory) == 0)
+        {
+            if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+                throw std::runtime_error("Cannot create " + directory + ": " + strerror(errno));
+            if (mDurable)
+            {
+                int root = open(Root().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (root != -1)
+                {
+                    fsync(root);
+                    close(root);
+                }
+            }
+            mCreated.insert(directory);
+        }
+        return directory;
+    }
+
+    /**
+     * @brief Marks a file as appended to by a writer, so that retention leaves
+     * it alone until it is closed.
+     */
+    void Open(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOpen.insert(path);
+    }
+
+    void Close(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOpen.erase(path);
+    }
+
+    /**
+     * @brief Paths of the files writers have open, as ListReportFiles gives them.
+     */
+    std::unordered_set<std::string> OpenFiles()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mOpen;
+    }
+
+private:
+    std::string mRoot;
+    Sharding mSharding;
+    size_t mShardCount;
+    bool mDurable;
+    std::mutex mMutex;
+    std::unordered_set<std::string> mCreated;
+    std::unordered_set<std::string> mOpen;
+};
+
+class ReportWriter : public CommandProcessor
+{
+public:
+    /**
+     * @param streamTag Distinguishes streams processed in parallel; when set,
+     * files are named bulk<time>_<tag>_<sequence>.log so that they never collide.
+     *
+     * Binary records are appended to bulk<time>.bin, so that bulks formed within
+     * the same second share a file instead of replacing each other.
+     *
+     * @param durability Syncs the files written, none if null.
+     * @param settings Format and compression to switch to between bulks, if not null.
+     * @param directory Where the files go, the working directory if null.
+     */
+    ReportWriter(CommandProcessor* nextCommandProcessor = nullptr, const std::string& streamTag = std::string(),
+        const ReportOptions& options = ReportOptions(), DurabilityManager* durability = nullptr,
+        const SettingsStore* settings = nullptr, ReportDirectory* directory = nullptr)
+        : CommandProcessor(nextCommandProcessor)
+        , mStreamTag(streamTag)
+        , mSequence(0)
+        , mOptions(options)
+        , mDurability(durability)
+        , mDirectory(directory)
+        , mSettings(settings)
+        , mSettingsVersion(settings ? settings->Version() : 0)
+        , mCompressor(CreateCompressor(options.Compression))
+        , mSegment(-1)
+        , mSegmentSequence(0)
+        , mSegmentBytes(0)
+        , mStream(-1)
+        , mStreamEmpty(true)
+    {
+    }
+
+    ~ReportWriter()
+    {
+        FinishSegment();
+        if (mStream != -1)
+        {
+            close(mStream);
+            unlink(mStreamTemporary.c_str());
+        }
+    }
+
+    void ProcessBulk(const Bulk& bulk) override
+    {
+        Reconfigure();
+        Write(bulk);
+        FlushSegment();
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulk(bulk);
+    }
+
+    /**
+     * @brief Writes the bulks with as few writes as their files allow: binary
+     * records bound for the same file are appended at once, and a segment
+     * receives the compressed output of the whole batch at once.
+     */
+    void ProcessBulks(const Bulk* bulks, size_t count) override
+    {
+        Reconfigure();
+        if (mOptions.Format == ReportFormat::Binary && !mCompressor)
+        {
+            auto seconds = [](const Bulk& bulk)
+            {
+                return std::chrono::duration_cast<std::chrono::seconds>(bulk.Timestamp.time_since_epoch()).count();
+            };
+            for (size_t first = 0, last = 0; first < count; first = last)
+            {
+                mRecord.clear();
+                do
+                    EncodeBulkRecord(bulks[last++], mRecord);
+                while (last < count && seconds(bulks[last]) == seconds(bulks[first]));
+                // Named only once the group is closed, as a stream tag numbers every name taken.
+                Store(GetFilename("bulk", bulks[first].Timestamp), bulks[first].Timestamp, mRecord, true);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < count; ++i)
+                Write(bulks[i]);
+            FlushSegment();
+        }
+
+        if (mNextCommandProcessor)
+            mNextCommandProcessor->ProcessBulks(bulks, count);
+    }
+
+    /**
+     * @brief Writes a streamed bulk, compressed as it comes, to a hidden
+     * .<name>.part next to its file, renamed into place once the bulk is
+     * finished; retention and compaction never see the partial file.
+     */
+    void StartStream(std::chrono::system_clock::time_point timestamp) override
+    {
+        Reconfigure();
+        std::string name = GetFilename("bulk", timestamp) + (mCompressor ? mCompressor->Extension() : "");
+        mStreamPath = GetPath(name, timestamp, mStreamDirectory);
+        mStreamTemporary = (mStreamDirectory.empty() ? std::string() : mStreamDirectory + '/') + '.' + name + ".part";
+        mStream = open(mStreamTemporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (mStream == -1)
+            throw std::runtime_error("Cannot open " + mStreamTemporary + ": " + strerror(errno));
+        mStreamEmpty = true;
+        WriteStream("bulk: ");
+
+        CommandProcessor::StartStream(timestamp);
+    }
+
+    void StreamCommands(const CommandList& commands) override
+    {
+        if (mStream != -1 && !commands.empty())
+        {
+            mRecord.clear();
+            for (const auto& command : commands)
+            {
+                if (!mStreamEmpty)
+                    mRecord.append(", ");
+                mRecord.append(command);
+                mStreamEmpty = false;
+            }
+            WriteStream(mRecord);
+        }
+
+        CommandProcessor::StreamCommands(commands);
+    }
+
+    void FinishStream(bool publish) override
+    {
+        if (mStream != -1)
+        {
+            int fd = mStream;
+            mStream = -1;
+            mBuffer.clear();
+            if (mCompressor)
+                mCompressor->Finish(mBuffer);
+            if (!publish)
+            {
+                close(fd);
+                unlink(mStreamTemporary.c_str());
+                CommandProcessor::FinishStream(publish);
+                return;
+            }
+
+            try
+            {
+                WriteAll(fd, mBuffer, mStreamTemporary);
+                // Synced before the rename with per-bulk durability, so that a published file is complete;
+                // Commit below counts the bulk once and finds no data left to sync.
+                if (mDurability && mOptions.Durability.Mode == Durability::Bulk && fdatasync(fd) == -1)
+                    throw std::runtime_error("Cannot sync " + mStreamTemporary + ": " + strerror(errno));
+                if (rename(mStreamTemporary.c_str(), mStreamPath.c_str()) == -1)
+                    throw std::runtime_error("Cannot rename " + mStreamTemporary + ": " + strerror(errno));
+            }
+            catch (...)
+            {
+                close(fd);
+                unlink(mStreamTemporary.c_str());
+                throw;
+            }
+            if (mDurability)
+                mDurability->Commit(fd, mStreamDirectory);
+            else
+                close(fd);
+        }
+
+        CommandProcessor::FinishStream(publish);
+    }
+
+private:
+    void WriteStream(std::string_view data)
+    {
+        if (!mCompressor)
+        {
+            WriteAll(mStream, data, mStreamTemporary);
+            return;
+        }
+        mBuffer.clear();
+        mCompressor->Compress(data, mBuffer);
+        WriteAll(mStream, mBuffer, mStreamTemporary);
+    }
+
+    /**
+     * @brief Writes one bulk; segment output is only buffered until FlushSegment.
+     */
+    void Write(const Bulk& bulk)
+    {
+        bool binary = mOptions.Format == ReportFormat::Binary;
+        std::string_view payload = bulk.Text;
+        if (binary)
+        {
+            mRecord.clear();
+            EncodeBulkRecord(bulk, mRecord);
+            payload = mRecord;
+        }
+
+        if (!mCompressor)
+            Store(GetFilename("bulk", bulk.Timestamp), bulk.Timestamp, payload, binary);
+        else if (!mOptions.Compression.Segment)
+        {
+            mBuffer.clear();
+            mCompressor->Compress(payload, mBuffer);
+            mCompressor->Finish(mBuffer);
+            Store(GetFilename("bulk", bulk.Timestamp) + mCompressor->Extension(), bulk.Timestamp, mBuffer, binary);
+        }
+        else
+            WriteSegment(payload, bulk.Timestamp);
+    }
+
+    void Reconfigure()
+    {
+        if (!mSettings || mSettings->Version() == mSettingsVersion)
+            return;
+
+        auto settings = mSettings->Get(mSettingsVersion);
+        FinishSegment();
+        mOptions.Format = settings->Report.Format;
+        mOptions.Compression = settings->Report.Compression;
+        mCompressor = CreateCompressor(mOptions.Compression);
+    }
+
+    void Store(const std::string& name, std::chrono::system_clock::time_point timestamp, std::string_view data,
+        bool append)
+    {
+        std::string directory;
+        int fd = WriteFile(GetPath(name, timestamp, directory), data, append);
+        if (mDurability)
+            mDurability->Commit(fd, directory);
+        else
+            close(fd);
+    }
+
+    /**
+     * @param directory Receives the directory of the file, empty for the working directory.
+     */
+    std::string GetPath(const std::string& name, std::chrono::system_clock::time_point timestamp,
+        std::string& directory)
+    {
+        directory = mDirectory ? mDirectory->Get(name, timestamp) : std::string();
+        return directory.empty() ? name : directory + '/' + name;
+    }
+
+    void WriteSegment(std::string_view payload, std::chrono::system_clock::time_point timestamp)
+    {
+        if (mSegment == -1)
+        {
+            std::string directory;
+            mSegmentPath = GetPath(GetFilename("segment", timestamp, ++mSegmentSequence) + mCompressor->Extension(),
+                timestamp, directory);
+            mSegment = open(mSegmentPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (mSegment == -1)
+                throw std::runtime_error("Cannot open " + mSegmentPath + ": " + strerror(errno));
+            if (mDirectory)
+                mDirectory->Open(mSegmentPath);
+            if (mDurability)
+            {
+                try
+                {
+                    mDurability->Open(mSegment, directory);
+                }
+                catch (...)
+                {
+                    close(mSegment);
+                    mSegment = -1;
+                    if (mDirectory)
+                        mDirectory->Close(mSegmentPath);
+                    throw;
+                }
+            }
+        }
+
+        mCompressor->Compress(payload, mSegmentBuffer);
+        mSegmentBytes += payload.size();
+        if (mOptions.Format == ReportFormat::Text)
+        {
+            mCompressor->Compress("\n", mSegmentBuffer);
+            ++mSegmentBytes;
+        }
+
+        if (mSegmentBytes >= mOptions.Compression.SegmentSize)
+            FinishSegment();
+    }
+
+    /**
+     * @brief Writes the compressed output buffered for the open segment.
+     */
+    void FlushSegment()
+    {
+        if (mSegment == -1 || mSegmentBuffer.empty())
+            return;
+
+        try
+        {
+            WriteAll(mSegment, mSegmentBuffer, mSegmentPath);
+        }
+        catch (...)
+        {
+            mSegmentBuffer.clear();
+            throw;
+        }
+        mSegmentBuffer.clear();
+        if (mDurability)
+            mDurability->Written(mSegment);
+    }
+
+    void FinishSegment()
+    {
+        if (mSegment == -1)
+            return;
+
+        mCompressor->Finish(mSegmentBuffer);
+        try
+        {
+            FlushSegment();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+        if (mDurability)
+        {
+            try
+            {
+                mDurability->Written(mSegment);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+            mDurability->Close(mSegment);
+        }
+        else
+            close(mSegment);
+        mSegment = -1;
+        mSegmentBytes = 0;
+        if (mDirectory)
+            mDirectory->Close(mSegmentPath);
+    }
+
+    /**
+     * @param sequence Numbers files that may be created within the same second.
+     */
+    std::string GetFilename(const char* prefix, std::chrono::system_clock::time_point timestamp,
+        unsigned long long sequence = 0)
+    {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+        timestamp.time_since_epoch()).count();
+        std::stringstream filename;
+        filename << prefix << seconds;
+        if (!mStreamTag.empty())
+            filename << '_' << mStreamTag << '_' << (sequence ? sequence : ++mSequence);
+        else if (sequence)
+            filename << '_' << sequence;
+        filename << (mOptions.Format == ReportFormat::Binary ? ".bin" : ".log");
+        return filename.str();
+    }
+
+    std::string mStreamTag;
+    unsigned long long mSequence;
+    ReportOptions mOptions;
+    DurabilityManager* mDurability;
+    ReportDirectory* mDirectory;
+    const SettingsStore* mSettings;
+    uint64_t mSettingsVersion;
+    std::unique_ptr<Compressor> mCompressor;
+    int mSegment;
+    std::string mSegmentPath;
+    unsigned long long mSegmentSequence;
+    size_t mSegmentBytes;
+    std::string mRecord;
+    std::string mBuffer;
+    std::string mSegmentBuffer;
+    // Temporary file of the bulk being streamed, -1 if none.
+    int mStream;
+    std::string mStreamTemporary;
+    std::string mStreamPath;
+    std::string mStreamDirectory;
+    bool mStreamEmpty;
+};
+
+/**
+ * @brief ReportWriter, moved to a worker thread when it compresses or syncs every bulk.
+ */
+class ReportStage
+{
+public:
+    ReportStage(const std::string& streamTag, const ReportOptions& options, ReportDirectory& directory,
+        DurabilityManager& durability, CommandProcessor* nextCommandProcessor = nullptr,
+        const SettingsStore* settings = nullptr)
+        : mReportWriter(nextCommandProcessor, streamTag, options, &durability, settings, &directory)
+        , mEnabled(options.Enabled)
+        , mNextCommandProcessor(nextCommandProcessor)
+    {
+        auto backpressure = options.Backpressure;
+        if (backpressure.SpillDirectory.empty())
+            backpressure.SpillDirectory = options.Directory;
+        if (options.Enabled &&
+            (options.Compression.Codec != Compression::None || options.Durability.Mode == Durability::Bulk ||
+            backpressure.Mode != Overflow::Block || backpressure.Rate != 0 || options.DegradeConsole))
+        {
+            mAsyncProcessor = std::make_unique<AsyncProcessor>(&mReportWriter, &mLoad, options.QueueSize,
+                backpressure, "report");
+        }
+        mDegradeConsole = options.DegradeConsole && options.Enabled;
+    }
+
+    /**
+     * @brief The processor to pass bulks to; the next one if reports are disabled.
+     */
+    CommandProcessor* Get()
+    {
+        if (!mEnabled)
+            return mNextCommandProcessor;
+        if (mAsyncProcessor)
+            return mAsyncProcessor.get();
+        return &mReportWriter;
+    }
+
+    /**
+     * @brief Load of the worker thread; null when the writer runs inline.
+     */
+    const SinkLoad* Load() const
+    {
+        return mAsyncProcessor ? &mLoad : nullptr;
+    }
+
+    /**
+     * @brief Load the console output gives way to, null unless console output degrades.
+     */
+    const SinkLoad* Degrade() const
+    {
+        return mDegradeConsole ? &mLoad : nullptr;
+    }
+
+private:
+    ReportWriter mReportWriter;
+    bool mEnabled;
+    CommandProcessor* mNextCommandProcessor;
+    SinkLoad mLoad;
+    std::unique_ptr<AsyncProcessor> mAsyncProcessor;
+    bool mDegradeConsole;
+};
+
+} // namespace bulk
@@ -0,0 +1,124 @@
+#include "test_util.h"
+
+/**
+ * @brief Keeps the text of every bulk, with a + after a continued one.
+ */
+class TextSink : public BulkSink
+{
+public:
+    void Write(const Bulk& bulk) override
+    {
+        Texts.push_back(bulk.Text + (bulk.Continued ? "+" : ""));
+    }
+
+    std::vector<std::string> Texts;
+};
+
+static void TestSplitBlock()
+{
+    TextSink sink;
+    {
+        BulkEngine engine({{"bulk-size", "1"}, {"block-limit", "2"}, {"block-overflow", "split"},
+            {"reports", "false"}});
+        engine.AddSink(sink);
+        engine.SubmitLines("{\na\nb\n}\n{\nc\nd\ne\n}\n{\nf\ng\nh\ni\nj\n");
+    }
+    std::vector<std::string> expected = {"bulk: a, b", "bulk: c, d, ...+", "bulk: e", "bulk: f, g, ...+",
+        "bulk: h, i, ...+"};
+    CHECK(sink.Texts == expected);
+}
+
+static void TestStreamRejectsSinks()
+{
+    TextSink sink;
+    BulkEngine engine({{"bulk-size", "1"}, {"block-limit", "2"}, {"block-overflow", "stream"}, {"reports", "false"}});
+    bool rejected = false;
+    try
+    {
+        engine.AddSink(sink);
+    }
+    catch (const std::invalid_argument&)
+    {
+        rejected = true;
+    }
+    CHECK(rejected);
+}
+
+/**
+ * @brief Prints the console output and the reports of bulk run on the input.
+ */
+static std::string RunReports(const std::string& input, const std::vector<std::string>& options)
+{
+    TemporaryDirectory directory;
+    auto path = directory.Path() + "/input.txt";
+    WriteFile(path, input);
+    std::vector<std::string> arguments = {"3", path, "--output-dir=" + directory.Path() + "/reports"};
+    arguments.insert(arguments.end(), options.begin(), options.end());
+    auto result = Run(arguments);
+    if (result.Status != 0 && result.Error.find("not supported by this build") != std::string::npos)
+        return std::string();
+    CHECK(result.Status == 0);
+
+    std::vector<std::string> cat = {"--cat"};
+    for (const auto& file : directory.Files())
+    {
+        if (file != path)
+            cat.push_back(file);
+    }
+    if (cat.size() == 1)
+        return result.Output;
+    auto printed = Run(cat);
+    CHECK(printed.Status == 0);
+    return result.Output + "--\n" + printed.Output;
+}
+
+static void TestStreamMatchesKeep()
+{
+    // Bulks of the same second overwrite each other's file, so the reports
+    // are compared for a single block; the console for many bulks.
+    std::string block = "{\n";
+    for (int i = 0; i < 5000; ++i)
+        block.append("command").append(std::to_string(i)).append("\n");
+    block.append("}\n");
+    std::string bulks = "a\nb\nc\nd\n" + block + "e\n{\nf\n}\n" + block + "g\n";
+
+    for (const char* codec : {"none", "gzip"})
+    {
+        std::vector<std::string> options = {"--block-limit=64", "--compress=" + std::string(codec)};
+        auto keep = RunReports(block, options);
+        options.push_back("--block-overflow=stream");
+        auto stream = RunReports(block, options);
+        CHECK(stream == keep);
+    }
+
+    auto keep = RunReports(bulks, {"--block-limit=64", "--reports=false"});
+    auto stream = RunReports(bulks, {"--block-limit=64", "--reports=false", "--block-overflow=stream"});
+    CHECK(!keep.empty());
+    CHECK(stream == keep);
+}
+
+static void TestEngineRejectsProcessSettings()
+{
+    for (const char* key : {"jobs", "memory-limit"})
+    {
+        bool rejected = false;
+        try
+        {
+            BulkEngine engine({{"bulk-size", "1"}, {"reports", "false"}, {key, "2"}});
+        }
+        catch (const std::invalid_argument&)
+        {
+            rejected = true;
+        }
+        CHECK(rejected);
+    }
+}
+
+int main()
+{
+    TestSplitBlock();
+    TestStreamRejectsSinks();
+    TestStreamMatchesKeep();
+    TestEngineRejectsProcessSettings();
+    return Finish();
+}
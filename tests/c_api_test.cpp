@@ -0,0 +1,68 @@
+#include "test_util.h"
+#include "bulk_c.h"
+
+static void CollectBulk(void* context, const bulk_view* bulk)
+{
+    auto* bulks = static_cast<std::vector<std::string>*>(context);
+    std::string commands;
+    for (size_t i = 0; i < bulk->count; ++i)
+        commands.append(bulk->commands[i].data, bulk->commands[i].size).append(";");
+    bulks->push_back(std::string(bulk->text, bulk->text_size) + '|' + commands);
+}
+
+static void TestCInterface()
+{
+    CHECK(bulk_abi_version() == BULK_ABI_VERSION);
+
+    TemporaryDirectory directory;
+    const char* keys[] = {"bulk-size", "output-dir"};
+    const char* values[] = {"2", directory.Path().c_str()};
+    bulk_engine* engine = nullptr;
+    CHECK(bulk_engine_create(keys, values, 2, &engine) == BULK_OK);
+    if (!engine)
+        return;
+
+    std::vector<std::string> bulks;
+    CHECK(bulk_engine_add_sink(engine, CollectBulk, &bulks) == BULK_OK);
+    CHECK(bulk_submit(engine, "a", 1) == BULK_OK);
+    bulk_command batch[] = {{"b", 1}, {"cc", 2}, {"d", 1}};
+    CHECK(bulk_submit_batch(engine, batch, 3) == BULK_OK);
+    const char buffer[] = "efg";
+    size_t offsets[] = {0, 1, 3};
+    CHECK(bulk_submit_buffer(engine, buffer, offsets, 2) == BULK_OK);
+    size_t decreasing[] = {0, 2, 1};
+    CHECK(bulk_submit_buffer(engine, buffer, decreasing, 2) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_submit_buffer(engine, nullptr, offsets, 2) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_submit_buffer(engine, buffer, nullptr, 2) == BULK_ERROR_INVALID_ARGUMENT);
+    bulk_command nullCommand[] = {{"x", 1}, {nullptr, 1}};
+    CHECK(bulk_submit_batch(engine, nullCommand, 2) == BULK_ERROR_INVALID_ARGUMENT);
+    const char lines[] = "{\nh\ni\nj\n}\nk";
+    CHECK(bulk_submit_lines(engine, lines, sizeof(lines) - 1) == BULK_OK);
+    CHECK(bulk_flush(engine) == BULK_OK);
+    CHECK(bulk_tick(engine) == BULK_OK);
+    bulk_engine_destroy(engine);
+
+    std::vector<std::string> expected = {
+        "bulk: a, b|a;b;", "bulk: cc, d|cc;d;", "bulk: e, fg|e;fg;", "bulk: h, i, j|h;i;j;", "bulk: k|k;"};
+    CHECK(bulks == expected);
+
+    CHECK(bulk_submit(nullptr, "a", 1) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_submit_batch(nullptr, batch, 3) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_submit_buffer(nullptr, buffer, offsets, 2) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_submit_lines(nullptr, lines, sizeof(lines) - 1) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_flush(nullptr) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(bulk_tick(nullptr) == BULK_ERROR_INVALID_ARGUMENT);
+
+    const char* badKeys[] = {"bulk-size"};
+    const char* badValues[] = {"none"};
+    engine = nullptr;
+    CHECK(bulk_engine_create(badKeys, badValues, 1, &engine) == BULK_ERROR_INVALID_ARGUMENT);
+    CHECK(engine == nullptr);
+    CHECK(bulk_last_error()[0] != '\0');
+}
+
+int main()
+{
+    TestCInterface();
+    return Finish();
+}
@@ -0,0 +1,63 @@
+#include "test_util.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <ctime>
+#include <thread>
+
+/**
+ * @brief Writes a text report named after the timestamp, modified at the given time.
+ */
+static void WriteReport(const std::string& directory, int64_t timestamp, time_t modified)
+{
+    auto path = directory + "/bulk" + std::to_string(timestamp) + ".log";
+    WriteFile(path, "bulk: " + std::to_string(timestamp));
+    timespec times[2] = {{modified, 0}, {modified, 0}};
+    CHECK(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+static void TestCompactionLookup()
+{
+    TemporaryDirectory directory;
+    for (int64_t timestamp : {100, 200, 300})
+        WriteReport(directory.Path(), timestamp, timestamp);
+    WriteReport(directory.Path(), 400, time(nullptr));
+    {
+        BulkEngine engine({{"bulk-size", "1"}, {"output-dir", directory.Path()}, {"compact-age", "60"},
+            {"compact-interval", "10"}});
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    auto files = directory.Files();
+    CHECK(files.size() == 2);
+    CHECK(files.size() == 2 && files[0].find("/archive100_") != std::string::npos);
+    CHECK(files.back() == directory.Path() + "/bulk400.log");
+
+    // Archived and recent bulks are found alike.
+    for (int64_t timestamp : {100, 200, 300, 400})
+    {
+        auto result = Run({"--lookup=" + std::to_string(timestamp), directory.Path()});
+        CHECK(result.Status == 0);
+        CHECK(result.Output == "bulk: " + std::to_string(timestamp) + "\n");
+    }
+
+    auto missing = Run({"--lookup=250", directory.Path()});
+    CHECK(missing.Status != 0);
+    CHECK(missing.Output.empty());
+    CHECK(missing.Error.find("No bulk at 250") != std::string::npos);
+
+    auto archive = ReadFile(files.front());
+    // Flips a bit of the index checksum in the footer.
+    archive[archive.size() - 20] ^= 1;
+    WriteFile(files.front(), archive);
+    auto corrupt = Run({"--lookup=200", directory.Path()});
+    CHECK(corrupt.Status != 0);
+    CHECK(corrupt.Error.find("checksum mismatch") != std::string::npos);
+}
+
+int main()
+{
+    TestCompactionLookup();
+    return Finish();
+}
@@ -0,0 +1,66 @@
+#include "test_util.h"
+
+/**
+ * @brief Writes the input with the given options and returns what --cat prints
+ * for the report files, or nothing if the codec is not built in.
+ */
+static bool CatReports(const std::string& input, const std::vector<std::string>& options, std::string& console,
+    std::string& reports)
+{
+    TemporaryDirectory directory;
+    auto path = directory.Path() + "/input.txt";
+    WriteFile(path, input);
+    std::vector<std::string> arguments = {"2", path, "--output-dir=" + directory.Path() + "/reports"};
+    arguments.insert(arguments.end(), options.begin(), options.end());
+    auto result = Run(arguments);
+    if (result.Status != 0 && result.Error.find("not supported by this build") != std::string::npos)
+        return false;
+    CHECK(result.Status == 0);
+    console = result.Output;
+
+    std::vector<std::string> cat = {"--cat"};
+    for (const auto& file : directory.Files())
+    {
+        if (file != path)
+            cat.push_back(file);
+    }
+    CHECK(cat.size() > 1);
+    auto printed = Run(cat);
+    CHECK(printed.Status == 0);
+    CHECK(printed.Error.empty());
+    reports = printed.Output;
+    return true;
+}
+
+static void TestCompressedRoundTrip()
+{
+    std::string input;
+    for (int i = 0; i < 1000; ++i)
+        input.append("command").append(std::to_string(i)).append(i % 7 == 0 ? "\n{\n" : i % 7 == 3 ? "\n}\n" : "\n");
+
+    for (const char* codec : {"gzip", "lz4", "zstd"})
+    {
+        std::string console, reports;
+        // A single bulk, as bulks of the same second overwrite each other's file.
+        if (CatReports("a\nb\n", {"--compress=" + std::string(codec)}, console, reports))
+        {
+            CHECK(console == "bulk: a, b\n");
+            CHECK(reports == console);
+        }
+        for (const char* format : {"text", "binary"})
+        {
+            if (CatReports(input, {"--compress=" + std::string(codec), "--compress-mode=segment",
+                "--segment-size=4096", "--format=" + std::string(format)}, console, reports))
+            {
+                CHECK(!console.empty());
+                CHECK(reports == console);
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestCompressedRoundTrip();
+    return Finish();
+}
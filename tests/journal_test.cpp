@@ -0,0 +1,95 @@
+#include "test_util.h"
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Builds a journal as Journal appends it: a type, the payload size and the payload.
+ */
+class JournalBuilder
+{
+public:
+    JournalBuilder& Record(char type, std::string_view payload = std::string_view())
+    {
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        mData.push_back(type);
+        mData.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        mData.append(payload);
+        return *this;
+    }
+
+    JournalBuilder& Line(std::string_view text)
+    {
+        return Record('L', text);
+    }
+
+    JournalBuilder& Stamp(int64_t seconds)
+    {
+        int64_t nanoseconds = seconds * 1000000000;
+        return Record('S', std::string_view(reinterpret_cast<const char*>(&nanoseconds), sizeof(nanoseconds)));
+    }
+
+    const std::string& Data() const
+    {
+        return mData;
+    }
+
+private:
+    std::string mData;
+};
+
+/**
+ * @brief A crash left a written bulk, a formed but unwritten one, a pending
+ * command and an open block in the journal.
+ */
+static void TestRecovery(const std::string& durability)
+{
+    TemporaryDirectory directory;
+    auto journal = directory.Path() + "/journal";
+    auto input = directory.Path() + "/input.txt";
+    auto reports = directory.Path() + "/reports";
+    WriteFile(journal, JournalBuilder()
+        .Line("a").Stamp(1000000000).Line("b").Record('F').Record('W')
+        .Line("c").Stamp(1000000100).Record('F')
+        .Line("d").Stamp(1000000200)
+        .Line("{").Line("e").Stamp(1000000300)
+        .Data());
+    WriteFile(input, "");
+
+    auto result = Run({"2", input, "--journal=" + journal, "--output-dir=" + reports, "--durability=" + durability});
+    CHECK(result.Status == 0);
+    CHECK(result.Error.empty());
+    // The written bulk is skipped, and the open block is discarded as at the end of input.
+    CHECK(result.Output == "bulk: c\nbulk: d\n");
+    auto files = directory.Files();
+    std::vector<std::string> expected = {input, journal, reports + "/bulk1000000100.log",
+        reports + "/bulk1000000200.log"};
+    CHECK(files == expected);
+    if (files == expected)
+    {
+        CHECK(ReadFile(expected[2]) == "bulk: c");
+        CHECK(ReadFile(expected[3]) == "bulk: d");
+    }
+    // Everything recovered and everything read since is written, so the journal is emptied.
+    CHECK(ReadFile(journal).empty());
+}
+
+static void TestJournalNeedsSyncedFiles()
+{
+    TemporaryDirectory directory;
+    auto journal = directory.Path() + "/journal";
+    for (const auto& option : {"--durability=none", "--compress-mode=segment"})
+    {
+        auto result = Run({"2", "--journal=" + journal, "--durability=group", option});
+        CHECK(result.Status == 1);
+        CHECK(result.Error.find("The journal needs") != std::string::npos);
+    }
+}
+
+int main()
+{
+    TestRecovery("bulk");
+    TestRecovery("group");
+    TestJournalNeedsSyncedFiles();
+    return Finish();
+}
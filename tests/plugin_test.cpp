@@ -0,0 +1,58 @@
+#include "test_util.h"
+
+/**
+ * @brief Feeds the input to bulk with the test plugin writing to a file, and
+ * returns what the plugin wrote.
+ */
+static std::string RunPlugin(const std::string& input, const std::vector<std::string>& options,
+    RunResult& result)
+{
+    TemporaryDirectory directory;
+    auto path = directory.Path() + "/input.txt";
+    auto output = directory.Path() + "/plugin.txt";
+    WriteFile(path, input);
+    std::vector<std::string> arguments = {"2", path, "--reports=false"};
+    arguments.insert(arguments.end(), options.begin(), options.end());
+    for (auto& argument : arguments)
+    {
+        auto at = argument.find("@output");
+        if (at != std::string::npos)
+            argument.replace(at, 7, output);
+    }
+    result = Run(arguments);
+    return ReadFile(output);
+}
+
+static void TestPluginCompletesLater()
+{
+    std::string input;
+    for (int i = 0; i < 1000; ++i)
+        input.append("command").append(std::to_string(i)).append(i % 9 == 0 ? "\n{\n" : i % 9 == 4 ? "\n}\n" : "\n");
+
+    RunResult result;
+    auto written = RunPlugin(input, {"--plugin=" TEST_PLUGIN " @output", "--metrics"}, result);
+    CHECK(result.Status == 0);
+    CHECK(!result.Output.empty());
+    // Every bulk is delivered, in order, before bulk exits.
+    CHECK(written == result.Output);
+    CHECK(result.Error.find("plugin.test.failed_batches 0\n") != std::string::npos);
+    CHECK(result.Error.find("plugin.test.abandoned_bulks 0\n") != std::string::npos);
+}
+
+static void TestPluginAbandonedAtDeadline()
+{
+    RunResult result;
+    auto written = RunPlugin("a\nb\nc\n", {"--plugin=" TEST_PLUGIN " @output hold", "--shutdown-deadline=100"},
+        result);
+    CHECK(result.Status == 0);
+    CHECK(result.Output == "bulk: a, b\nbulk: c\n");
+    CHECK(written.empty());
+    CHECK(result.Error.find("Plugin test did not complete") != std::string::npos);
+}
+
+int main()
+{
+    TestPluginCompletesLater();
+    TestPluginAbandonedAtDeadline();
+    return Finish();
+}
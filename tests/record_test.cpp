@@ -0,0 +1,141 @@
+#include "test_util.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+
+/**
+ * @brief Writes one bulk as a binary report and returns the record.
+ */
+static std::string WriteBinaryReport(const TemporaryDirectory& directory)
+{
+    {
+        BulkEngine engine({{"bulk-size", "3"}, {"output-dir", directory.Path()}, {"format", "binary"}});
+        engine.Submit("a");
+        engine.Submit("");
+        engine.Submit("ccc");
+    }
+    auto files = directory.Files();
+    CHECK(files.size() == 1);
+    return files.empty() ? std::string() : files[0];
+}
+
+static void TestRecordRoundTrip()
+{
+    TemporaryDirectory directory;
+    auto path = WriteBinaryReport(directory);
+    auto result = Run({"--cat", path});
+    CHECK(result.Status == 0);
+    CHECK(result.Output == "bulk: a, , ccc\n");
+    CHECK(result.Error.empty());
+}
+
+static void TestRecordChecksumMismatch()
+{
+    TemporaryDirectory directory;
+    auto path = WriteBinaryReport(directory);
+    auto record = ReadFile(path);
+    CHECK(!record.empty());
+    record.back() ^= 1;
+    WriteFile(path, record);
+    auto result = Run({"--cat", path});
+    CHECK(result.Status != 0);
+    CHECK(result.Output.empty());
+    CHECK(result.Error.find("checksum mismatch") != std::string::npos);
+}
+
+static void TestRecordTruncated()
+{
+    TemporaryDirectory directory;
+    auto path = WriteBinaryReport(directory);
+    auto record = ReadFile(path);
+    for (size_t size : {size_t(30), record.size() - 1})
+    {
+        WriteFile(path, record.substr(0, size));
+        auto result = Run({"--cat", path});
+        CHECK(result.Status != 0);
+        CHECK(result.Output.empty());
+        CHECK(result.Error.find("Truncated bulk record") != std::string::npos);
+    }
+}
+
+static void TestRecordOverflowingSizes()
+{
+    TemporaryDirectory directory;
+    auto path = WriteBinaryReport(directory);
+    auto record = ReadFile(path);
+    // Count at offset 4 and DataSize at offset 16 of the header, chosen so that
+    // their sum with the header size wraps around to the size of the record.
+    uint32_t count = UINT32_MAX;
+    uint64_t dataSize = uint64_t(record.size()) - 40 - uint64_t(count) * sizeof(uint64_t);
+    memcpy(&record[4], &count, sizeof(count));
+    memcpy(&record[16], &dataSize, sizeof(dataSize));
+    WriteFile(path, record);
+    auto result = Run({"--cat", path});
+    CHECK(result.Output.empty());
+    CHECK(result.Error.find("Truncated bulk record") != std::string::npos);
+
+    count = 1;
+    dataSize = UINT64_MAX - 7;
+    memcpy(&record[4], &count, sizeof(count));
+    memcpy(&record[16], &dataSize, sizeof(dataSize));
+    WriteFile(path, record);
+    result = Run({"--cat", path});
+    CHECK(result.Output.empty());
+    CHECK(result.Error.find("Truncated bulk record") != std::string::npos);
+}
+
+/**
+ * @brief Binary records of a stream batched behind the report queue go to one
+ * file per second, numbered without gaps.
+ */
+static void TestRecordBatchesPerStream()
+{
+    TemporaryDirectory input;
+    TemporaryDirectory output;
+    std::string commands;
+    for (int i = 0; i < 20000; ++i)
+        commands += std::to_string(i) + '\n';
+    std::vector<std::string> arguments = {"1", "--jobs=2", "--format=binary", "--report-overflow=drop",
+        "--queue-size=100000", "--output-dir=" + output.Path()};
+    for (const char* name : {"/a", "/b"})
+    {
+        WriteFile(input.Path() + name, commands);
+        arguments.push_back(input.Path() + name);
+    }
+    auto result = Run(arguments);
+    CHECK(result.Status == 0);
+
+    // The console keeps the writer behind, so batches of many bulks reach it.
+    auto files = output.Files();
+    CHECK(files.size() < 40000);
+    std::map<std::string, std::set<unsigned long>> sequences;
+    for (const auto& file : files)
+    {
+        auto name = file.substr(file.rfind('/') + 1);
+        auto tag = name.find('_');
+        auto sequence = name.find('_', tag + 1);
+        CHECK(tag != std::string::npos && sequence != std::string::npos);
+        if (sequence != std::string::npos)
+            sequences[name.substr(tag + 1, sequence - tag - 1)].insert(std::stoul(name.substr(sequence + 1)));
+    }
+    CHECK(sequences.size() == 2);
+    for (const auto& stream : sequences)
+        CHECK(*stream.second.rbegin() == stream.second.size());
+
+    files.insert(files.begin(), "--cat");
+    auto cat = Run(files);
+    CHECK(cat.Status == 0);
+    CHECK(std::count(cat.Output.begin(), cat.Output.end(), '\n') == 40000);
+}
+
+int main()
+{
+    TestRecordRoundTrip();
+    TestRecordChecksumMismatch();
+    TestRecordTruncated();
+    TestRecordOverflowingSizes();
+    TestRecordBatchesPerStream();
+    return Finish();
+}
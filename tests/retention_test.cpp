@@ -0,0 +1,84 @@
+#include "test_util.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <ctime>
+#include <thread>
+
+/**
+ * @brief Writes a report file modified at the given time.
+ */
+static void WriteReport(const std::string& path, time_t modified)
+{
+    WriteFile(path, "bulk: " + path);
+    timespec times[2] = {{modified, 0}, {modified, 0}};
+    CHECK(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+static bool Contains(const std::vector<std::string>& files, const std::string& part)
+{
+    for (const auto& file : files)
+    {
+        if (file.find(part) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+static void TestRetentionKeepsNewest()
+{
+    TemporaryDirectory directory;
+    WriteReport(directory.Path() + "/bulk100.log", 100);
+    WriteReport(directory.Path() + "/bulk300.log", 300);
+    WriteReport(directory.Path() + "/bulk200.log", 200);
+    {
+        BulkEngine engine({{"bulk-size", "1"}, {"output-dir", directory.Path()}, {"retention-age", "1"},
+            {"retention-interval", "10"}});
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    CHECK(directory.Files() == std::vector<std::string>{directory.Path() + "/bulk300.log"});
+}
+
+/**
+ * @brief An open segment is kept even when newer files push it out.
+ */
+static void TestRetentionKeepsOpenSegment()
+{
+    TemporaryDirectory directory;
+    try
+    {
+        BulkEngine engine({{"bulk-size", "1"}, {"output-dir", directory.Path()}, {"compress", "gzip"},
+            {"compress-mode", "segment"}, {"retention-files", "1"}, {"retention-interval", "10"}});
+        engine.Submit("a");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        CHECK(Contains(directory.Files(), "/segment"));
+        WriteReport(directory.Path() + "/bulk100.log", time(nullptr) + 1000);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        CHECK(Contains(directory.Files(), "/segment"));
+    }
+    catch (const std::exception& e)
+    {
+        CHECK(std::string(e.what()).find("not supported by this build") != std::string::npos);
+        return;
+    }
+
+    auto files = directory.Files();
+    CHECK(files.size() == 2);
+    std::vector<std::string> cat = {"--cat"};
+    for (const auto& file : files)
+    {
+        if (file.find("/segment") != std::string::npos)
+            cat.push_back(file);
+    }
+    auto result = Run(cat);
+    CHECK(result.Status == 0);
+    CHECK(result.Output == "bulk: a\n");
+}
+
+int main()
+{
+    TestRetentionKeepsNewest();
+    TestRetentionKeepsOpenSegment();
+    return Finish();
+}
@@ -0,0 +1,51 @@
+#include "test_util.h"
+
+/**
+ * @brief Returns the value of a metric printed by --metrics.
+ */
+static uint64_t Metric(const std::string& metrics, const std::string& name)
+{
+    auto at = metrics.find(name + ' ');
+    return at == std::string::npos ? 0 : std::stoull(metrics.substr(at + name.size() + 1));
+}
+
+/**
+ * @brief Bulks spilled beyond a full report queue reach the reports in the
+ * order they were formed; binary records of the same second are appended to
+ * one file, so that order shows in the file.
+ */
+static void TestSpillKeepsOrder()
+{
+    TemporaryDirectory directory;
+    auto path = directory.Path() + "/input.txt";
+    std::string input;
+    for (int i = 0; i < 20000; ++i)
+        input.append(std::to_string(i)).append(i % 11 == 0 ? "\n{\n" : i % 11 == 5 ? "\n}\n" : "\n");
+    WriteFile(path, input);
+    auto reports = directory.Path() + "/reports";
+    auto result = Run({"3", path, "--format=binary", "--queue-size=1", "--report-overflow=spill",
+        "--report-spill-dir=" + directory.Path(), "--output-dir=" + reports, "--metrics"});
+    CHECK(result.Status == 0);
+    // The console keeps the writer behind, so the queue of one overflows.
+    CHECK(Metric(result.Error, "report.spilled") > 0);
+    CHECK(Metric(result.Error, "report.spill_failures") == 0);
+
+    std::vector<std::string> cat = {"--cat"};
+    for (const auto& file : directory.Files())
+    {
+        if (file.compare(0, reports.size() + 1, reports + '/') == 0)
+            cat.push_back(file);
+    }
+    CHECK(cat.size() > 1);
+    auto printed = Run(cat);
+    CHECK(printed.Status == 0);
+    CHECK(printed.Output == result.Output);
+    // The spill file is unlinked from the start, so nothing is left next to the input.
+    CHECK(directory.Files().size() == cat.size());
+}
+
+int main()
+{
+    TestSpillKeepsOrder();
+    return Finish();
+}
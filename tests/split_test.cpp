@@ -0,0 +1,46 @@
+#include "test_util.h"
+
+#include <random>
+
+/**
+ * @brief Commands with nested blocks, empty lines and stray closing braces,
+ * large enough to be cut into several chunks.
+ */
+static std::string MakeInput(size_t size)
+{
+    std::mt19937 random(29);
+    std::string input;
+    for (size_t i = 0; input.size() < size; ++i)
+    {
+        auto choice = random() % 100;
+        if (choice < 4)
+            input.append("{\n");
+        else if (choice < 8)
+            input.append("}\n");
+        else if (choice < 10)
+            input.append("\n");
+        else
+            input.append("command").append(std::to_string(i)).append(1, '\n');
+    }
+    return input;
+}
+
+static void TestSplitMatchesSequential()
+{
+    TemporaryDirectory directory;
+    auto path = directory.Path() + "/input.txt";
+    WriteFile(path, MakeInput(40 * 1024 * 1024));
+
+    auto sequential = Run({"7", path, "--reports=false"});
+    auto split = Run({"7", path, "--reports=false", "--jobs=3"});
+    CHECK(sequential.Status == 0);
+    CHECK(split.Status == 0);
+    CHECK(!sequential.Output.empty());
+    CHECK(split.Output == sequential.Output);
+}
+
+int main()
+{
+    TestSplitMatchesSequential();
+    return Finish();
+}
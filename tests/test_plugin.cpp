@@ -0,0 +1,116 @@
+#include "bulk_plugin.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Completes every batch later, from a thread of its own.
+ *
+ * The config is the file the bulk texts are appended to, one per line,
+ * optionally followed by " hold" to never complete a batch.
+ */
+class TestPlugin
+{
+public:
+    TestPlugin(const std::string& config, const bulk_plugin_host* host)
+        : mHost(*host)
+        , mHold(false)
+        , mStopped(false)
+    {
+        auto space = config.find(' ');
+        mOutput.open(config.substr(0, space), std::ios::app);
+        mHold = space != std::string::npos && config.substr(space + 1) == "hold";
+        mThread = std::thread([this]() { Run(); });
+    }
+
+    ~TestPlugin()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mCondition.notify_all();
+        mThread.join();
+    }
+
+    bool Good() const
+    {
+        return mOutput.good();
+    }
+
+    /**
+     * @brief Copies the texts, as the batch may be completed before they are written.
+     */
+    int Write(const bulk_view* bulks, size_t count, uint64_t sequence)
+    {
+        std::string texts;
+        for (size_t i = 0; i < count; ++i)
+            texts.append(bulks[i].text, bulks[i].text_size).append("\n");
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mBatches.emplace_back(sequence, std::move(texts));
+        }
+        mCondition.notify_all();
+        return BULK_PLUGIN_PENDING;
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            mCondition.wait(lock, [this]() { return (!mBatches.empty() && !mHold) || mStopped; });
+            if (mStopped)
+                return;
+            auto batch = std::move(mBatches.front());
+            mBatches.pop_front();
+            lock.unlock();
+            mOutput << batch.second << std::flush;
+            mHost.complete(mHost.context, batch.first, mOutput.good() ? BULK_OK : BULK_ERROR_FAILED);
+            lock.lock();
+        }
+    }
+
+    bulk_plugin_host mHost;
+    std::ofstream mOutput;
+    bool mHold;
+    bool mStopped;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::pair<uint64_t, std::string>> mBatches;
+    std::thread mThread;
+};
+
+extern "C" const bulk_plugin* bulk_plugin_entry(void)
+{
+    static const bulk_plugin plugin = {
+        BULK_PLUGIN_ABI_VERSION,
+        "test",
+        [](const char* config, const bulk_plugin_host* host, void** instance)
+        {
+            auto* plugin = new TestPlugin(config, host);
+            if (!plugin->Good())
+            {
+                delete plugin;
+                return static_cast<int>(BULK_ERROR_FAILED);
+            }
+            *instance = plugin;
+            return static_cast<int>(BULK_OK);
+        },
+        [](void* instance, const bulk_view* bulks, size_t count, uint64_t sequence)
+        {
+            return static_cast<TestPlugin*>(instance)->Write(bulks, count, sequence);
+        },
+        [](void* instance)
+        {
+            delete static_cast<TestPlugin*>(instance);
+        }
+    };
+    return &plugin;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "bulk.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+inline int Failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++Failures; \
+        } \
+    } while (false)
+
+/**
+ * @brief A directory removed with its files when the test is done.
+ */
+class TemporaryDirectory
+{
+public:
+    TemporaryDirectory()
+    {
+        char path[] = "/tmp/bulk_test.XXXXXX";
+        if (!mkdtemp(path))
+            throw std::runtime_error("Cannot create a temporary directory");
+        mPath = path;
+    }
+
+    ~TemporaryDirectory()
+    {
+        Remove(mPath);
+    }
+
+    TemporaryDirectory(const TemporaryDirectory&) = delete;
+    TemporaryDirectory& operator=(const TemporaryDirectory&) = delete;
+
+    const std::string& Path() const
+    {
+        return mPath;
+    }
+
+    /**
+     * @brief Files in the directory and its subdirectories, sorted.
+     */
+    std::vector<std::string> Files() const
+    {
+        std::vector<std::string> files;
+        List(mPath, files);
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+private:
+    static void List(const std::string& directory, std::vector<std::string>& files)
+    {
+        if (DIR* entries = opendir(directory.c_str()))
+        {
+            while (dirent* entry = readdir(entries))
+            {
+                if (entry->d_name[0] == '.')
+                    continue;
+                std::string path = directory + '/' + entry->d_name;
+                if (entry->d_type == DT_DIR)
+                    List(path, files);
+                else
+                    files.push_back(path);
+            }
+            closedir(entries);
+        }
+    }
+
+    static void Remove(const std::string& directory)
+    {
+        if (DIR* entries = opendir(directory.c_str()))
+        {
+            while (dirent* entry = readdir(entries))
+            {
+                if (entry->d_name[0] == '.')
+                    continue;
+                std::string path = directory + '/' + entry->d_name;
+                if (entry->d_type == DT_DIR)
+                    Remove(path);
+                else
+                    unlink(path.c_str());
+            }
+            closedir(entries);
+        }
+        rmdir(directory.c_str());
+    }
+
+    std::string mPath;
+};
+
+inline std::string ReadFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+inline void WriteFile(const std::string& path, const std::string& data)
+{
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+struct RunResult
+{
+    int Status;
+    std::string Output;
+    std::string Error;
+};
+
+/**
+ * @brief Runs the bulk command line, capturing what it prints.
+ *
+ * Console output is written to the descriptor as well as through std::cout,
+ * so standard output is redirected to a temporary file for the run.
+ */
+inline RunResult Run(const std::vector<std::string>& arguments)
+{
+    std::vector<const char*> argv = {"bulk"};
+    for (const auto& argument : arguments)
+        argv.push_back(argument.c_str());
+
+    char path[] = "/tmp/bulk_test_output.XXXXXX";
+    int output = mkstemp(path);
+    if (output == -1)
+        throw std::runtime_error("Cannot create a temporary file");
+    unlink(path);
+
+    std::cout.flush();
+    int savedOutput = dup(STDOUT_FILENO);
+    dup2(output, STDOUT_FILENO);
+    std::ostringstream error;
+    auto* cerrBuffer = std::cerr.rdbuf(error.rdbuf());
+    int status = BulkCommandLine(static_cast<int>(argv.size()), argv.data());
+    std::cout.flush();
+    std::cerr.rdbuf(cerrBuffer);
+    dup2(savedOutput, STDOUT_FILENO);
+    close(savedOutput);
+
+    RunResult result{status, std::string(), error.str()};
+    char buffer[4096];
+    for (off_t offset = 0; ; )
+    {
+        ssize_t size = pread(output, buffer, sizeof(buffer), offset);
+        if (size <= 0)
+            break;
+        result.Output.append(buffer, size);
+        offset += size;
+    }
+    close(output);
+    return result;
+}
+
+/**
+ * @brief Reports the failed checks as the exit status.
+ */
+inline int Finish()
+{
+    if (Failures != 0)
+    {
+        std::cerr << Failures << " checks failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}